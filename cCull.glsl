@@ -0,0 +1,40 @@
+#version 430
+
+// [GOZ]: Frustum culling for GPU-driven drawing, see scene.cpp. One invocation per object: objects whose
+// bounding sphere is inside the frustum are added as an instance to their mesh's draw command, with
+// their index written to that command's run of visibleObjects.
+
+layout(local_size_x = 64) in;
+
+#define OBJECT_TEXELS 10
+
+struct DrawCommand {
+	uint count;
+	uint instanceCount;
+	uint firstIndex;
+	int baseVertex;
+	uint baseInstance;
+};
+
+layout(std430, binding = 0) readonly buffer ObjectData { vec4 objectData[]; };
+layout(std430, binding = 1) buffer DrawCommands { DrawCommand commands[]; };
+layout(std430, binding = 2) readonly buffer MeshCommands { int meshCommands[]; };	// Command for each mesh
+layout(std430, binding = 3) writeonly buffer VisibleObjects { int visibleObjects[]; };
+
+uniform int numObjects;
+uniform vec4 frustumPlanes[6];	// World space, normals pointing in
+
+void main()
+{
+	int obj = int(gl_GlobalInvocationID.x);
+	if(obj >= numObjects) return;
+
+	vec4 sphere = objectData[obj * OBJECT_TEXELS + 8];	// Centre and radius
+	for(int p = 0; p < 6; p++)
+		if(dot(frustumPlanes[p].xyz, sphere.xyz) + frustumPlanes[p].w < -sphere.w) return;
+
+	int meshId = int(objectData[obj * OBJECT_TEXELS + 7].a);
+	int cmd = meshCommands[meshId];
+	uint slot = atomicAdd(commands[cmd].instanceCount, 1u);
+	visibleObjects[commands[cmd].baseInstance + slot] = obj;
+}
@@ -0,0 +1,16 @@
+#version 150
+
+// [GOZ]: The mesh's surface in one view of an impostor atlas, see Impostors in scene.cpp. Empty texels
+// are left cleared to 0, which is how fScene.glsl tells where the mesh isn't.
+
+in  vec3 normal;
+in  vec2 texCoord;
+
+out vec4 fColor;		// Texture coordinate, and 1 where the mesh is
+out vec4 fNormalDepth;	// Object space normal, and depth from the front of the bounding sphere (0) to the back (1)
+
+void main()
+{
+	fColor = vec4( texCoord, 1.0, 1.0 );
+	fNormalDepth = vec4( normalize( normal ) * 0.5 + 0.5, gl_FragCoord.z );
+}
@@ -1,82 +1,211 @@
 #version 150
 
+// [GOZ]: Compiled with any of these defined, see the shader variants in scene.cpp:
+//   LIT - shade the lights in this fragment's cluster, otherwise there is only global ambient light
+//   SPOTLIGHTS - test spotlight cones, otherwise every spotlight is a full light
+//   TEXTURED - sample the texture array, otherwise the texture is the single colour texColor
+//   INDIRECT - the object's values come from vScene.glsl rather than uniforms, and it is textured
+//              unless texLayer is -1
+//   IMPOSTOR - the surface comes from an impostor atlas, see Impostors in scene.cpp
+//   PICK - write pickId rather than a colour, see pickObject in scene.cpp
+
 in  vec2 texCoord;  // The third coordinate is always 0.0 and is discarded
 in  vec4 position;
 in  vec3 normal;
 
+#ifdef PICK
+#ifdef INDIRECT
+flat in int pickId;
+#else
+uniform int pickId;
+#endif
+out uint fPickId;
+#else
 out vec4 fColor;
+#endif
 
 vec4 color;
 
-uniform sampler2D texture;
+#if defined(TEXTURED) || defined(INDIRECT)
+uniform sampler2DArray texArray;	// [GOZ]: Every texture, one per layer
+uniform samplerBuffer layerMinLevels;	// [GOZ]: The finest mip level loaded in each layer, see streamTextures
+
+// [GOZ]: Sample a layer, using its finest loaded mip level wherever a finer one would be used
+vec4 sampleLayer( vec2 coord, int layer )
+{
+	vec2 texels = coord * vec2( textureSize( texArray, 0 ).xy );
+	vec2 dx = dFdx( texels ), dy = dFdy( texels );
+	float lod = 0.5 * log2( max( dot(dx, dx), dot(dy, dy) ) );
+	return textureLod( texArray, vec3( coord, layer ), max( lod, texelFetch( layerMinLevels, layer ).r ) );
+}
+#endif
+#ifdef INDIRECT
+flat in int texLayer;
+flat in float texScale;
+flat in vec3 texColor;
+flat in vec3 AmbientProduct, DiffuseProduct, SpecularProduct;
+flat in mat4 ModelView;
+flat in float Shininess;
+#else
+#ifdef TEXTURED
+uniform int texLayer;				// [GOZ]: The layer holding this object's texture
+uniform float texScale;
+#else
+uniform vec3 texColor;
+#endif
 uniform vec3 AmbientProduct, DiffuseProduct, SpecularProduct;
 uniform mat4 ModelView;
-uniform vec4 LightPosition;
 uniform float Shininess;
-uniform float texScale;
-uniform vec4 Light2Position;
-uniform vec3 Light1rgbBright;
-uniform vec3 Light2rgbBright;
-uniform float spread; //[TFD]: light1's spotsize, I don't like my variable names.
-uniform vec4 lightRot;	//[TFD]: the direction that light1 is pointing in.
+#endif
+
+// [GOZ]: Static meshes crossfade with their impostors, see Impostors in scene.cpp. The mesh keeps the
+// pixels whose dither value is below Fade and the impostor keeps the rest, so each pixel is drawn once.
+#ifndef SKINNED
+#ifdef INDIRECT
+flat in float Fade;
+#else
+uniform float Fade;
+#endif
+
+float dither()
+{
+	return fract( 52.9829189 * fract( dot( gl_FragCoord.xy, vec2(0.06711056, 0.00583715) ) ) );
+}
+#endif
+
+#ifdef IMPOSTOR
+uniform sampler2DArray impostorTexCoords;	// Texture coordinate and coverage, one atlas per layer
+uniform sampler2DArray impostorNormals;	// Object space normal and depth
+uniform int impostorLayer;
+uniform float impostorRadius;
+uniform mat4 Projection;
+in vec2 atlasCoord;
+flat in vec3 impostorDir;
+#endif
+
+// [GOZ]: Clustered lighting, see the Lighting section of scene.cpp. Each light is three texels:
+// view space position (direction for directional lights) and type, colour and spread, spot direction.
+#ifdef LIT
+#define LIGHT_POINT 1
+#define LIGHT_SPOT 2
+#define LIGHT_DIRECTIONAL 3
+uniform samplerBuffer lightData;
+uniform usamplerBuffer clusterLights;	// Offset into lightIndices and number of lights, for each cluster
+uniform usamplerBuffer lightIndices;
+uniform ivec3 clusterDims;
+uniform vec2 viewportSize;
+uniform float clusterScale, clusterBias;	// Depth slice = log(depth) * clusterScale + clusterBias
+
+// [GOZ]: 1 at the light, fading smoothly to 0 at its reach, beyond which it isn't binned to clusters
+float lightWindow( float dist, float reach )
+{
+	float x = dist / reach;
+	float w = max( 1.0 - x*x*x*x, 0.0 );
+	return w * w;
+}
+#endif
 
 void
 main()
 {    
-	// Transform vertex position into eye coordinates
-    vec3 pos = (ModelView * position).xyz;
+#ifdef IMPOSTOR
+	// [GOZ]: Move the card's fragment to the mesh surface baked into the atlas, and take its normal
+	if( dither() < Fade ) discard;
+	vec4 baked = texture( impostorTexCoords, vec3( atlasCoord, impostorLayer ) );
+	if( baked.b < 0.5 ) discard;
+	vec4 normalDepth = texture( impostorNormals, vec3( atlasCoord, impostorLayer ) );
+	vec4 surface = vec4( position.xyz + impostorDir * (1.0 - 2.0 * normalDepth.a) * impostorRadius, 1.0 );
+	vec3 surfaceNormal = normalDepth.rgb * 2.0 - 1.0;
+	vec2 uv = baked.rg;
+#else
+#ifndef SKINNED
+	if( Fade < 1.0 && dither() >= Fade ) discard;
+#endif
+	vec4 surface = position;
+	vec3 surfaceNormal = normal;
+	vec2 uv = texCoord;
+#endif
 
+	// Transform vertex position into eye coordinates
+    vec3 pos = (ModelView * surface).xyz;
+#ifdef IMPOSTOR
+	vec4 clip = Projection * vec4( pos, 1.0 );
+	gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+#endif
 
-    // The vector to the light from the vertex    
-    vec3 Lvec = LightPosition.xyz - pos;
+	vec3 lit = vec3(0.0, 0.0, 0.0);
+	vec3 specularSum = vec3(0.0, 0.0, 0.0);
 
-    // Unit direction vectors for Blinn-Phong shading calculation
-    vec3 L = normalize( Lvec );   // Direction to the light source
-	vec3 L2 = normalize( Light2Position.xyz );	// Negated direction of light from Light 2 (parallel source)
+#ifdef LIT
     vec3 E = normalize( -pos );   // Direction to the eye/camera
-    vec3 H = normalize( L + E );  // Halfway vector
-	vec3 H2 = normalize( L2 + E );
 
     // Transform vertex normal into eye coordinates (assumes scaling is uniform across dimensions)
-    vec3 N = normalize( (ModelView*vec4(normal, 0.0)).xyz );
-
-    // Compute terms in the illumination equation
-    vec3 ambient = Light1rgbBright * AmbientProduct;
-	vec3 ambient2 = Light2rgbBright * AmbientProduct;
-
-    float Kd = max( dot(L, N), 0.0 );
-    vec3  diffuse = Light1rgbBright * Kd*DiffuseProduct;
-	float Kd2 = max( dot(L2, N), 0.0 );
-    vec3  diffuse2 = Light2rgbBright * Kd2*DiffuseProduct;
-
-    float Ks = pow( max(dot(N, H), 0.0), Shininess );
-    vec3  specular = Light1rgbBright * Ks * SpecularProduct;
-	float Ks2 = pow( max(dot(N, H2), 0.0), Shininess );
-    vec3  specular2 = Light2rgbBright * Ks2 * SpecularProduct;
-
-	// [TFD]: PART J. Light has no effect on fragments outside cone of spotlight
-	if(dot(L,normalize(lightRot.xyz)) < spread){ // [TFD]: if the fragment is not in the cone of light
-		ambient = vec3(0.0, 0.0, 0.0);
-		diffuse = vec3(0.0, 0.0, 0.0);
-		specular = vec3(0.0, 0.0, 0.0);
+    vec3 N = normalize( (ModelView*vec4(surfaceNormal, 0.0)).xyz );
+
+	// [GOZ]: Find this fragment's cluster, and the range of lightIndices holding the lights that reach it
+	ivec2 tile = ivec2( gl_FragCoord.xy / viewportSize * vec2( clusterDims.xy ) );
+	int slice = int( max( log( -pos.z ) * clusterScale + clusterBias, 0.0 ) );
+	tile = min( tile, clusterDims.xy - 1 );
+	slice = min( slice, clusterDims.z - 1 );
+	uvec2 lights = texelFetch( clusterLights, tile.x + clusterDims.x * (tile.y + clusterDims.y * slice) ).xy;
+
+	for( uint i = 0u; i < lights.y; i++ ) {
+		int light = int( texelFetch( lightIndices, int(lights.x + i) ).r );
+		vec4 lightPosition = texelFetch( lightData, 3*light );
+		vec4 rgbSpread = texelFetch( lightData, 3*light + 1 );
+		vec4 directionReach = texelFetch( lightData, 3*light + 2 );
+		vec3 lightRot = directionReach.xyz;	// [TFD]: the direction a spotlight is pointing in.
+		int type = int( lightPosition.w );
+
+		// The vector to the light from the vertex, or the negated direction of a parallel source
+		vec3 Lvec = type == LIGHT_DIRECTIONAL ? lightPosition.xyz : lightPosition.xyz - pos;
+
+		// Unit direction vectors for Blinn-Phong shading calculation
+		vec3 L = normalize( Lvec );   // Direction to the light source
+		vec3 H = normalize( L + E );  // Halfway vector
+
+#ifdef SPOTLIGHTS
+		// [TFD]: PART J. Light has no effect on fragments outside cone of spotlight
+		if( type == LIGHT_SPOT && dot(L, lightRot) < rgbSpread.a ) continue;
+#endif
+
+		// Compute terms in the illumination equation
+		vec3 ambient = rgbSpread.rgb * AmbientProduct;
+
+		float Kd = max( dot(L, N), 0.0 );
+		vec3  diffuse = rgbSpread.rgb * Kd*DiffuseProduct;
+
+		float Ks = pow( max(dot(N, H), 0.0), Shininess );
+		vec3  specular = rgbSpread.rgb * Ks * SpecularProduct;
+
+		if( dot(L, N) < 0.0 ) {
+			specular = vec3(0.0, 0.0, 0.0);
+		}
+
+		// [GOZ]: PART F. Light from point lights and spotlights drops off like 1/(R/15 + 1), windowed to
+		// end at the light's reach. Light from directional lights does not drop off
+		float dist = sqrt(dot(Lvec, Lvec));
+		float falloff = type == LIGHT_DIRECTIONAL ? 1.0 : lightWindow( dist, directionReach.w ) / (dist/15 + 1);
+		lit += (ambient + diffuse) * falloff;
+		specularSum += specular * falloff;	// [TFD]: PART H. Specular is seperate from color.
 	}
-    
-    if( dot(L, N) < 0.0 ) {
-	specular = vec3(0.0, 0.0, 0.0);
-    } 
-	if( dot(L2, N) < 0.0 ) {
-	specular2 = vec3(0.0, 0.0, 0.0);
-    }
+#endif
 
     // globalAmbient is independent of distance from the light source
     vec3 globalAmbient = vec3(0.1, 0.1, 0.1);
-	float dropoff = sqrt(dot(Lvec, Lvec))/15 + 1;
-    color.rgb = ((ambient + diffuse) / dropoff) + globalAmbient + ambient2 + diffuse2;	// [GOZ]: PART F. Light due to Light 1 drops off like 1/(R/15 + 1)
-	// [TFD]: PART H. Specular is seperate from color. 
-	// [GOZ]: Light due to light 2 does not drop off
+    color.rgb = lit + globalAmbient;
     color.a = 1.0;
 
-    fColor = (color * texture2D( texture, texCoord * 2.0 * texScale )) + vec4( specular / dropoff + specular2, 1.0 );
+#if defined(PICK)
+    fPickId = uint( pickId );	// [GOZ]: The lighting above is unused, and compiled out
+#elif defined(INDIRECT)
+    vec4 texel = texLayer < 0 ? vec4( texColor, 1.0 ) : sampleLayer( uv * 2.0 * texScale, texLayer );
+    fColor = (color * texel) + vec4( specularSum, 1.0 );
+#elif defined(TEXTURED)
+    fColor = (color * sampleLayer( uv * 2.0 * texScale, texLayer )) + vec4( specularSum, 1.0 );
+#else
+    fColor = (color * vec4( texColor, 1.0 )) + vec4( specularSum, 1.0 );
+#endif
 	// [TFD]: PART H. Spec does not depend on texture
 	// [TFD]: PART J. texScale scales texCoord. larger texScale=>smaller texture
 }
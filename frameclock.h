@@ -0,0 +1,57 @@
+// A frame clock for running a simulation on a fixed timestep and drawing between its steps.
+// [GOZ]: Used by scene.cpp for animation. The timer is sampled once per frame, in tick().
+
+#include <chrono>
+#include <algorithm>
+
+class FrameClock {
+public:
+    // step is the simulation timestep in seconds.
+    FrameClock(double step = 1.0 / 120) : step(step), timeScale(1.0), paused(false),
+            fixedFrameTime(0.0), simTime(0.0), frameTime(0.0), accumulator(0.0) {
+        last = Clock::now();
+    }
+
+    // Sample the timer for a new frame, adding the scaled time since the last frame to the
+    // time the simulation is behind by. Nothing is added while paused, and long frames
+    // (e.g. while the window is being dragged) are cut short rather than caught up.
+    // With fixedFrameTime set, every frame takes exactly that long and the timer is ignored.
+    void tick() {
+        Clock::time_point now = Clock::now();
+        tick(fixedFrameTime > 0.0 ? fixedFrameTime : std::chrono::duration<double>(now - last).count());
+        last = now;
+    }
+
+    // Start a frame that took exactly `seconds`, e.g. as recorded from an earlier run's frameTime.
+    void tick(double seconds) {
+        frameTime = seconds;
+        if(!paused) accumulator += std::min(frameTime, maxFrameTime) * timeScale;
+    }
+
+    // Advance simTime by one step if the simulation is at least a step behind.
+    // Call until it returns false after each tick().
+    bool nextStep() {
+        if(accumulator < step) return false;
+        accumulator -= step;
+        simTime += step;
+        return true;
+    }
+
+    // How far the frame is from the previous step to the current one, between 0 and 1.
+    // Frames show the simulation this far between its last two states.
+    double alpha() const { return accumulator / step; }
+
+    const double step;
+    double timeScale; // Simulation seconds per real second
+    bool paused;
+    double fixedFrameTime; // Seconds per frame for a reproducible run, or 0 to use the timer
+    double simTime; // Seconds the simulation has run for, a whole number of steps
+    double frameTime; // Real seconds between the last two calls to tick()
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    static constexpr double maxFrameTime = 0.25;
+
+    Clock::time_point last;
+    double accumulator; // Scaled seconds the simulation is behind the clock
+};
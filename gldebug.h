@@ -0,0 +1,103 @@
+// GL error reporting, and labels for GL objects and passes.
+// [GOZ]: Included by scene.cpp straight after Angel.h, whose CheckError() it replaces.
+//
+// Release builds (compiled with -DNDEBUG) compile CheckError() and everything else here out. Debug
+// builds register a KHR_debug callback in initDebugOutput, which reports errors and performance
+// warnings as the driver finds them, without the glGetError round trip after each call. Without
+// KHR_debug, CheckError() falls back to glGetError. Labels and debug groups name what messages (and
+// GL debuggers) are about.
+
+#ifndef GLDEBUG_H
+#define GLDEBUG_H
+
+#include <cstdio>
+#include <cstdarg>
+
+#undef CheckError
+
+#ifdef NDEBUG
+
+#define CheckError() ((void)0)
+
+inline void initDebugOutput(bool synchronous) {}
+inline void labelObject(GLenum identifier, GLuint name, const char* format, ...) {}
+inline void pushDebugGroup(const char* name) {}
+inline void popDebugGroup() {}
+
+#else
+
+bool glDebugOn = false; // Whether the KHR_debug callback is reporting errors
+
+inline void checkGLError(const char* file, int line) {
+    GLenum err = glGetError();
+    if(err != GL_NO_ERROR) fprintf(stderr, "GL error 0x%04x at %s:%d\n", err, file, line);
+}
+
+#define CheckError() do { if(!glDebugOn) checkGLError(__FILE__, __LINE__); } while(0)
+
+static const char* debugSourceName(GLenum source) {
+    switch(source) {
+        case GL_DEBUG_SOURCE_API: return "API";
+        case GL_DEBUG_SOURCE_WINDOW_SYSTEM: return "window system";
+        case GL_DEBUG_SOURCE_SHADER_COMPILER: return "shader compiler";
+        case GL_DEBUG_SOURCE_THIRD_PARTY: return "third party";
+        case GL_DEBUG_SOURCE_APPLICATION: return "application";
+        default: return "other";
+    }
+}
+
+static const char* debugTypeName(GLenum type) {
+    switch(type) {
+        case GL_DEBUG_TYPE_ERROR: return "error";
+        case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: return "deprecated behaviour";
+        case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR: return "undefined behaviour";
+        case GL_DEBUG_TYPE_PORTABILITY: return "portability";
+        case GL_DEBUG_TYPE_PERFORMANCE: return "performance";
+        default: return "message";
+    }
+}
+
+static void APIENTRY debugMessage(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length,
+        const GLchar* message, const void* userParam) {
+    const char* level = severity == GL_DEBUG_SEVERITY_HIGH ? "high" :
+            severity == GL_DEBUG_SEVERITY_MEDIUM ? "medium" : "low";
+    fprintf(stderr, "GL %s %s (%s, id %u): %s\n", debugSourceName(source), debugTypeName(type), level, id, message);
+}
+
+// Start reporting through KHR_debug, if the driver has it. Synchronous messages arrive during the call
+// that caused them, so a breakpoint in debugMessage shows where they came from, at some cost in speed.
+inline void initDebugOutput(bool synchronous) {
+    if(!GLEW_KHR_debug) {
+        printf("No KHR_debug, checking for GL errors after calls instead\n");
+        return;
+    }
+    glEnable(GL_DEBUG_OUTPUT);
+    if(synchronous) glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+    glDebugMessageCallback(debugMessage, NULL);
+    glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, NULL, GL_FALSE);
+    glDebugOn = true;
+}
+
+// Name a GL object, which must have been bound at least once, with a printf style format.
+inline void labelObject(GLenum identifier, GLuint name, const char* format, ...) {
+    if(!glDebugOn) return;
+    char label[128];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(label, sizeof(label), format, args);
+    va_end(args);
+    glObjectLabel(identifier, name, -1, label);
+}
+
+// Messages (and GL debugger captures) between these are grouped under name.
+inline void pushDebugGroup(const char* name) {
+    if(glDebugOn) glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 0, -1, name);
+}
+
+inline void popDebugGroup() {
+    if(glDebugOn) glPopDebugGroup();
+}
+
+#endif
+
+#endif // GLDEBUG_H
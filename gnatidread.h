@@ -58,6 +58,53 @@ texture* loadTextureNum(int num) {
     return loadTexture(fileName);
 }
 
+// [GOZ]: Resample a texture to width x height with bilinear filtering, replacing its rgbData.
+// Used to give every layer of the texture array in scene.cpp the same size.
+void resizeTexture(texture* t, int width, int height) {
+    GLubyte *src = t->rgbData;
+    GLubyte *dst = (GLubyte*) malloc(3 * width * height);
+
+    for(int y=0; y < height; y++) {
+        float fy = (y + 0.5f) * t->height / height - 0.5f;
+        int y0 = fy < 0 ? 0 : (int)fy;
+        int y1 = y0+1 < t->height ? y0+1 : y0;
+        float wy = fy < 0 ? 0 : fy - y0;
+
+        for(int x=0; x < width; x++) {
+            float fx = (x + 0.5f) * t->width / width - 0.5f;
+            int x0 = fx < 0 ? 0 : (int)fx;
+            int x1 = x0+1 < t->width ? x0+1 : x0;
+            float wx = fx < 0 ? 0 : fx - x0;
+
+            for(int c=0; c < 3; c++) {
+                float top = src[3*(y0*t->width + x0) + c] * (1-wx) + src[3*(y0*t->width + x1) + c] * wx;
+                float bot = src[3*(y1*t->width + x0) + c] * (1-wx) + src[3*(y1*t->width + x1) + c] * wx;
+                dst[3*(y*width + x) + c] = (GLubyte)(top * (1-wy) + bot * wy + 0.5f);
+            }
+        }
+    }
+
+    free(src);
+    t->rgbData = dst;
+    t->width = width;
+    t->height = height;
+}
+
+// [GOZ]: Halve a square RGB image of size x size (a power of two, at least 2) with a 2x2 box filter,
+// writing it to dst. Used for the mip levels of the texture array in scene.cpp.
+void halveImage(const GLubyte *src, int size, GLubyte *dst) {
+    int half = size / 2;
+    for(int y=0; y < half; y++) {
+        const GLubyte *row0 = src + 3 * size * (2*y), *row1 = row0 + 3 * size;
+        for(int x=0; x < half; x++) {
+            for(int c=0; c < 3; c++) {
+                int sum = row0[6*x + c] + row0[6*x + 3 + c] + row1[6*x + c] + row1[6*x + 3 + c];
+                dst[3*(y*half + x) + c] = (GLubyte)((sum + 2) / 4);
+            }
+        }
+    }
+}
+
 //----------------------------------------------------------------------------
 
 // Initialise the Open Asset Importer toolkit
@@ -127,11 +174,13 @@ static mat2 leftTrans, middTrans;
 static int currButton = -1; 
 
 static int mouseX=0, mouseY=0; // These need to be updated in scene.c
+// [GOZ]: The window size, also updated in scene.cpp, as the tools run on a thread that can't ask GLUT
+static int toolWindowWidth=1, toolWindowHeight=1;
 
 
-static float currRawX() { return ((float)mouseX)/glutGet(GLUT_WINDOW_WIDTH); }
+static float currRawX() { return ((float)mouseX)/toolWindowWidth; }
 static float currRawY() { 
-    return ((float)(glutGet(GLUT_WINDOW_HEIGHT)-mouseY))/glutGet(GLUT_WINDOW_HEIGHT); 
+    return ((float)(toolWindowHeight-mouseY))/toolWindowHeight; 
 }
 
 static void doToolUpdateXY() { 
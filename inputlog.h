@@ -0,0 +1,140 @@
+// Recording and replaying input events, and frame time statistics for a session.
+// [GOZ]: Used by scene.cpp for --record and --replay. What each event means is up to scene.cpp.
+
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+
+// One input event, run by the simulation at the start of frame `frame`.
+struct InputEvent {
+    int frame;
+    double time; // Milliseconds since the program started, for reference only
+    char type;
+    int args[4];
+};
+
+// A log file: a header line, then one line per event and one per frame with the seconds the frame's
+// clock advanced by, then an end line with the session's frame count. Frame lines needn't be in order.
+//   scene-input 2 <seed> <window width> <window height>
+//   <frame> <time> <type> <arg> <arg> <arg> <arg>
+//   frame <frame> <seconds>
+//   end <frame>
+class InputLog {
+public:
+    InputLog() : seed(0), width(0), height(0), endFrame(-1), fp(NULL), next(0) {}
+
+    // Start a new log, returning false if the file can't be written.
+    bool create(const char* fileName, unsigned int seed, int width, int height) {
+        fp = fopen(fileName, "w");
+        if(fp == NULL) return false;
+        fprintf(fp, "scene-input 2 %u %d %d\n", seed, width, height);
+        return true;
+    }
+
+    void write(const InputEvent& e) {
+        fprintf(fp, "%d %.3f %c %d %d %d %d\n", e.frame, e.time, e.type, e.args[0], e.args[1], e.args[2], e.args[3]);
+    }
+
+    // Record how long a frame took. Written in full precision, so a replay adds up to the same times.
+    void writeFrame(int frame, double seconds) {
+        fprintf(fp, "frame %d %.17g\n", frame, seconds);
+    }
+
+    // Finish a log being written, with the frame the session ended at.
+    void close(int frame) {
+        if(fp == NULL) return;
+        fprintf(fp, "end %d\n", frame);
+        fclose(fp);
+        fp = NULL;
+    }
+
+    // Read a whole log, returning false if it can't be read, isn't a log, or has an event that valid
+    // (if given) rejects. Without an end line (e.g. the recording crashed), the session ends just after
+    // the last event.
+    bool read(const char* fileName, bool (*valid)(const InputEvent&) = NULL) {
+        FILE* in = fopen(fileName, "r");
+        if(in == NULL) return false;
+        int version;
+        if(fscanf(in, "scene-input %d %u %d %d ", &version, &seed, &width, &height) != 4 || version != 2) {
+            fclose(in);
+            return false;
+        }
+        char line[256];
+        bool ok = true, ended = false;
+        while(ok && !ended && fgets(line, sizeof(line), in) != NULL) {
+            InputEvent e;
+            int frame;
+            double seconds;
+            if(sscanf(line, "frame %d %lf", &frame, &seconds) == 2 && frame >= 0) {
+                if((size_t)frame >= frameTimes.size()) frameTimes.resize(frame + 1, -1.0);
+                frameTimes[frame] = seconds;
+            } else if(sscanf(line, "end %d", &endFrame) == 1) {
+                ended = true;
+            } else if(sscanf(line, "%d %lf %c %d %d %d %d", &e.frame, &e.time, &e.type,
+                    &e.args[0], &e.args[1], &e.args[2], &e.args[3]) == 7 && (valid == NULL || valid(e))) {
+                events.push_back(e);
+            } else {
+                ok = false;
+            }
+        }
+        fclose(in);
+        if(!ended) endFrame = events.empty() ? 0 : events.back().frame + 1;
+        return ok;
+    }
+
+    // The next event read if it is for frame `frame` or earlier, otherwise NULL.
+    const InputEvent* nextFor(int frame) {
+        if(next >= events.size() || events[next].frame > frame) return NULL;
+        return &events[next++];
+    }
+
+    // The recorded seconds for frame `frame`, or fallback if it wasn't recorded.
+    double frameTime(int frame, double fallback) const {
+        if(frame < 0 || (size_t)frame >= frameTimes.size() || frameTimes[frame] < 0.0) return fallback;
+        return frameTimes[frame];
+    }
+
+    unsigned int seed;
+    int width, height;
+    int endFrame;
+
+private:
+    FILE* fp;
+    std::vector<InputEvent> events;
+    std::vector<double> frameTimes; // Indexed by frame, -1 where missing
+    size_t next;
+};
+
+// Collects the time of each frame and reports their distribution and the slowest frames.
+class FrameStats {
+public:
+    void add(double ms) { times.push_back(ms); }
+
+    void report(FILE* out) const {
+        if(times.empty()) return;
+        std::vector<double> sorted(times);
+        std::sort(sorted.begin(), sorted.end());
+        double total = 0.0;
+        for(size_t i=0; i < sorted.size(); i++) total += sorted[i];
+
+        fprintf(out, "Frame times over %d frames (ms): mean %.2f, median %.2f, 95%% %.2f, 99%% %.2f, max %.2f\n",
+                (int)sorted.size(), total / sorted.size(), percentile(sorted, 0.5), percentile(sorted, 0.95),
+                percentile(sorted, 0.99), sorted.back());
+
+        std::vector<int> slowest(times.size());
+        for(size_t i=0; i < times.size(); i++) slowest[i] = i;
+        int nSlowest = std::min((int)slowest.size(), 5);
+        std::partial_sort(slowest.begin(), slowest.begin() + nSlowest, slowest.end(),
+                [this](int a, int b) { return times[a] > times[b]; });
+        fprintf(out, "Slowest frames:");
+        for(int i=0; i < nSlowest; i++) fprintf(out, " %d (%.2f ms)", slowest[i], times[slowest[i]]);
+        fprintf(out, "\n");
+    }
+
+private:
+    static double percentile(const std::vector<double>& sorted, double p) {
+        return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+    }
+
+    std::vector<double> times; // Indexed by frame
+};
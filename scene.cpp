@@ -1,9 +1,14 @@
 
 #include "Angel.h"
+#include "gldebug.h"	// [GOZ]: Replaces Angel.h's CheckError(), which release builds (-DNDEBUG) compile out
 
 #include <stdlib.h>
 #include <dirent.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <string>
+#include <vector>
+#include <algorithm>
 
 // Open Asset Importer header files (in ../../assimp--3.0.1270/include)
 #include <assimp/cimport.h>
@@ -14,21 +19,57 @@
 // This file contains parts of the code that you shouldn't need to modify (but, you can).
 #include "gnatidread.h"
 #include "gnatidread2.h"	// [TFD]: Part D.B2, download at http://undergraduate.csse.uwa.edu.au/units/CITS3003/gnatidread2.h
+#include "skeleton.h"
+#include "threadpool.h"
+#include "frameclock.h"
+#include "inputlog.h"
+#include "texdecode.h"
+#include "softrast.h"
 
 #define NUM_LG 3	// [GOZ]: Number of Lights/Grounds
 #define PI 3.14159265359 // [TFD]: Pi for use with sin functions
 
 using namespace std;    // Import the C++ standard functions (e.g., min) 
 
+bool glDebugSync = false; // [GOZ]: Set with --gl-debug-sync, see gldebug.h
+
 char saveFile[256];	// [TFD]:considering letting command line arguments include save location
 const int numSaves = 5;
 char saveDefault[] = "sceneSave";
 
 // [TFD]: part D.B3
-// IDs for the GLSL program and GLSL variables.
-GLuint shaderProgram; // The number identifying the GLSL shader program
-GLuint vPosition, vNormal, vTexCoord, vBoneIDs, vBoneWeights; // IDs for vshader input vars (from glGetAttribLocation)
-GLuint projectionU, modelViewU, boneTransformsU; // IDs for uniform variables (from glGetUniformLocation)
+// IDs for the vshader input vars. [GOZ]: These are bound before linking, so that every shader variant
+// can use the same VAOs.
+enum { vPosition = 0, vNormal = 1, vTexCoord = 2, vBoneIDs = 3, vBoneWeights = 4, vObjectIndex = 5 };
+
+// [GOZ]: The scene shaders are compiled into variants with #defines, so each object can be drawn with the
+// cheapest program that handles it. The flags combine to give the variant's index in shaderVariants.
+enum {
+	VARIANT_SKINNED = 1,	// Blend bone transforms (otherwise the mesh is drawn as is)
+	VARIANT_LIT = 2,		// Shade the lights in the fragment's cluster (otherwise only global ambient)
+	VARIANT_SPOTLIGHTS = 4,	// Test spotlight cones (otherwise every light is a full light)
+	VARIANT_TEXTURED = 8,	// Sample the texture array (otherwise use the texture's single plain colour)
+	VARIANT_SKIN_ONE_BONE = 16,	// With VARIANT_SKINNED, only use each vertex's most influential bone
+	VARIANT_INDIRECT = 32,	// GPU-driven drawing, with each object's values from objectData (never SKINNED or TEXTURED)
+	VARIANT_IMPOSTOR = 64,	// Draw a static mesh's impostor (never SKINNED or INDIRECT)
+	VARIANT_PICK = 128	// Write the object's pick ID instead of a colour (only INDIRECT or IMPOSTOR), see pickObject
+};
+const int numVariants = 256;
+
+typedef struct {
+	GLuint program; // The number identifying the GLSL shader program
+	// IDs for uniform variables (from glGetUniformLocation)
+	GLint projectionU, modelViewU, boneTransformsU;
+	GLint texArrayU, texLayerU, texScaleU, texColorU;
+	GLint ambientProductU, diffuseProductU, specularProductU, shininessU;
+	GLint lightDataU, clusterLightsU, lightIndicesU, clusterDimsU, viewportSizeU, clusterScaleU, clusterBiasU;
+	GLint viewU, objectDataU, layerMinLevelsU;
+	GLint fadeU, impostorTexCoordsU, impostorNormalsU, impostorLayerU, impostorRadiusU, pickIdU;
+	int frameUniformsSet; // The frame that the per-frame uniforms were last set for
+} ShaderVariant;
+
+ShaderVariant shaderVariants[numVariants];
+int currVariant = -1; // The variant whose program is in use
 
 
 static float viewDist = 15; // Distance from the camera to the centre of the scene. 
@@ -37,7 +78,12 @@ static float camRotSidewaysDeg=0; // rotates the camera sideways around the cent
 static float camRotUpAndOverDeg=20; // rotates the camera up and over the centre.
 
 mat4 projection; // Projection matrix - set in the reshape function
+mat4 simProjection; // [GOZ]: A copy of projection for the simulation thread, also set via reshape
 mat4 view; // View matrix - set in the display function.
+float frustumRight, frustumTop; // [GOZ]: Half the width and height of the view frustum at the near plane
+const float zNear = 0.2, zFar = 1000.0; // [GOZ]: Near and far planes of the view frustum
+
+ThreadPool* workerPool; // [GOZ]: Worker threads for CPU work that can be split up, see startWorkerPool
 
 // These are used to set the window title
 char lab[] = "Project1";
@@ -45,18 +91,107 @@ char *programName = NULL; // Set in main
 int numDisplayCalls = 0; // Used to calculate the number of frames per second
 
 GLint windowHeight=640, windowWidth=960;
+GLint renderHeight=640, renderWidth=960; // [GOZ]: The size the scene is drawn at, less than the window with dynamic resolution
 
 // -----Meshes----------------------------------------------------------
 // Uses the type aiMesh from ../../assimp--3.0.1270/include/assimp/mesh.h
 //                      (numMeshes is defined in gnatidread.h)
-aiMesh* meshes[numMeshes]; // For each mesh we have a pointer to the mesh to draw
+// [GOZ]: Once a mesh is in its VAO only this is kept, and the aiScene it came from is released.
+typedef struct {
+	int numFaces;
+	int numBones;
+	int numVertices;
+	int baseVertex, firstIndex;	// Where the mesh is in the shared buffers, or -1 if it has its own (see GPU-driven drawing)
+	Skeleton skeleton;	// Bones and animations (see skeleton.h), empty if the mesh has no bones
+} MeshData;
+
+MeshData* meshes[numMeshes]; // For each mesh we have a pointer to the mesh to draw, or NULL if it isn't loaded
 GLuint vaoIDs[numMeshes]; // and a corresponding VAO ID from glGenVertexArrays
-const aiScene* scenes[numMeshes]; // [TFD]: part D.B4
+GLuint meshBuffers[numMeshes][4]; // [GOZ]: The vertex, element, boneID and boneWeight buffers in each VAO
+float meshRadius[numMeshes]; // [GOZ]: Distance from each mesh's origin to its furthest vertex, set when loaded
+
+// [GOZ]: First-fit allocation of ranges of a buffer, in elements. Used for the shared mesh buffers.
+typedef struct {
+	vector<pair<int, int> > free; // The start and length of each free range, in order
+} RangeAllocator;
+
+// The start of a free range of n elements, now taken, or -1 if there isn't one
+int allocRange(RangeAllocator* a, int n) {
+	for(size_t r=0; r < a->free.size(); r++) {
+		if(a->free[r].second < n) continue;
+		int start = a->free[r].first;
+		a->free[r].first += n;
+		a->free[r].second -= n;
+		if(a->free[r].second == 0) a->free.erase(a->free.begin() + r);
+		return start;
+	}
+	return -1;
+}
+
+void freeRange(RangeAllocator* a, int start, int n) {
+	size_t r = 0;
+	while(r < a->free.size() && a->free[r].first < start) r++;
+	a->free.insert(a->free.begin() + r, make_pair(start, n));
+	if(r+1 < a->free.size() && start + n == a->free[r+1].first) { // Merge with the next range
+		a->free[r].second += a->free[r+1].second;
+		a->free.erase(a->free.begin() + r + 1);
+	}
+	if(r > 0 && a->free[r-1].first + a->free[r-1].second == start) { // and the previous one
+		a->free[r-1].second += a->free[r].second;
+		a->free.erase(a->free.begin() + r);
+	}
+}
+
+// [GOZ]: The shared vertex and index buffers for GPU-driven drawing. Vertices are interleaved position,
+// texture coordinate and normal.
+bool gpuDriven = false; // Set in initGPUDriven if the extensions are there
+bool gpuDrivenAllowed = true; // Cleared by --no-gpu-driven
+const int sharedVertexFloats = 3 + 2 + 3;
+const int sharedVertexCapacity = 1 << 20, sharedIndexCapacity = 4 << 20;
+GLuint sharedVertexBuffer, sharedIndexBuffer;
+RangeAllocator sharedVertices, sharedIndices;
 
 // -----Textures---------------------------------------------------------
 //                      (numTextures is defined in gnatidread.h)
 texture* textures[numTextures]; // An array of texture pointers - see gnatidread.h
-GLuint textureIDs[numTextures]; // Stores the IDs returned by glGenTextures
+// [GOZ]: All textures live in the layers of one GL_TEXTURE_2D_ARRAY, so that a frame binds textures once.
+// Each resident texture is given a free layer, resampled to texArraySize x texArraySize if it isn't
+// that size already.
+GLuint textureArrayID; // The ID returned by glGenTextures for the texture array
+int texArraySize = 512; // Set with --texture-size=N, rounded down to a power of two
+int numTexLevels; // Mip levels in the array, down to 1 x 1
+int numTexSlots = numTextures; // Number of layers in the array, reduced to fit the VRAM budget
+int texSlots[numTextures]; // The layer holding each texture, or -1 if it isn't resident
+int slotTextures[numTextures]; // The texture held in each layer, or -1 if the layer is free
+int texPlain[numTextures]; // [GOZ]: 1 if the texture is a single colour, 0 if not, -1 if not known yet
+vec3 texPlainColor[numTextures]; // The colour of each plain texture
+vector<GLubyte> texMips[numTextures]; // Mip levels 1 and up of each texture in memory, one after another
+
+// [GOZ]: Texture streaming, see streamTextures
+const int texStreamStartSize = 64; // Mip levels this size and smaller are loaded with the layer
+size_t texUploadBudget = (size_t)1 << 20; // Bytes of finer levels uploaded per frame, set with --texture-upload=KB
+const int texDropDelay = 120; // Frames a level must go unneeded before it is dropped
+bool sparseTextures = false; // Whether layers only have memory for their loaded levels (ARB_sparse_texture)
+GLint sparseLevels; // Levels from this one down are the sparse mip tail, which is committed as a whole
+int texMinLevel[numTextures]; // The finest level loaded in each resident texture's layer
+int texWantLevel[numTextures]; // The finest level this frame's objects need, numTexLevels if none
+int texDropFrames[numTextures]; // Frames the finest loaded level has gone unneeded
+int texLevelUploads = 0, texLevelDrops = 0;
+GLfloat layerMinLevels[numTextures]; // texMinLevel for each layer, read by fScene.glsl
+bool layerTailCommitted[numTextures]; // Whether each layer's sparse mip tail is committed, see commitTexLevel
+GLuint layerMinLevelBuffer, layerMinLevelTexture;
+bool layerMinLevelsChanged = true;
+
+// [GOZ]: Impostor atlases, see Impostors. Each layer of the two arrays is one mesh's atlas.
+const int impostorGrid = 8; // Views along each side of an atlas, as IMPOSTOR_GRID in vScene.glsl
+const int impostorCell = 64; // Size of each view in texels
+const int numImpostorSlots = 8; // Layers in the arrays
+int impostorSize = 32; // Screen radius in pixels below which objects are impostors, set with --impostor-size=N
+int impostorSlots[numMeshes]; // The layer holding each mesh's atlas, or -1
+int slotImpostors[numImpostorSlots]; // The mesh whose atlas is in each layer, or -1
+int impostorLastUsed[numImpostorSlots];
+int impostorBakes = 0;
+GLuint impostorTexCoords, impostorNormals;
 
 
 // ------Scene Objects----------------------------------------------------
@@ -64,7 +199,15 @@ GLuint textureIDs[numTextures]; // Stores the IDs returned by glGenTextures
 // For each object in a scene we store the following
 // Note: the following is exactly what the sample solution uses, you can do things differently if you want.
 
-float lightSpread = -1.0;	// [TFD]: PART J. spotlight conesize, -1.0 is for a full light, 1.0 for no light.
+// [GOZ]: Any object can be a light. Point lights and spotlights drop off like 1/(R/15 + 1) up to their
+// reach (see gatherLights), directional lights are a parallel source in the direction of the object from
+// the origin and don't drop off.
+// Spotlights shine along the object's rotated Y axis.  The values match LIGHT_* in fScene.glsl.
+enum { LIGHT_NONE = 0, LIGHT_POINT = 1, LIGHT_SPOT = 2, LIGHT_DIRECTIONAL = 3 };
+
+// [GOZ]: Lights reach to where their dropoff leaves this fraction of their intensity, see gatherLights.
+// Set with --light-cutoff=F and kept in save files. 0 is the original unwindowed 1/(R/15 + 1) falloff.
+float lightReachFraction = 1.0 / 8;
 
 typedef struct {
 	vec4 loc;
@@ -77,11 +220,13 @@ typedef struct {
 	int meshId;
 	int texId;
 	float texScale;
-	unsigned int animStart;	// [TFD]: Records time of object creation
+	float animStart;	// [TFD]: Records time of object creation [GOZ]: in frameClock.simTime seconds
 	float FPC;			// [TFD]: The number of full animations per movement cycle
 	float moveSpeed;	// [TFD]: The speed an animated object will travel
 	float moveDist; 	// [TFD]: twice the distance an animated object will travel before returning
 	int numFrames;
+	int lightType;		// [GOZ]: One of LIGHT_NONE, LIGHT_POINT, LIGHT_SPOT or LIGHT_DIRECTIONAL
+	float spread;		// [TFD]: PART J. spotlight conesize, -1.0 is for a full light, 1.0 for no light.
 } SceneObject;
 
 const int maxObjects = 1024; // Scenes with more than 1024 objects seem unlikely
@@ -89,34 +234,787 @@ const int maxObjects = 1024; // Scenes with more than 1024 objects seem unlikely
 SceneObject sceneObjs[maxObjects]; // An array storing the objects currently in the scene.
 int nObjects=0; // How many objects are currenly in the scene.
 int currObject=-1; // The current object
-int mouseObj = -1;	// [GOZ]: PART J. The object currently under the mouse, -1 is no object
+atomic<int> mouseObj(-1);	// [GOZ]: PART J. The object currently under the mouse, -1 is no object. Set by display.
 
-// [TFD]: Stores the pause time and the resume time for animations
-unsigned int animationPause = 0;
+// [GOZ]: Animation runs on a fixed timestep, see stepSimulation. Pausing just pauses the clock.
+FrameClock frameClock;
 float POSE_TIME = 0.0;
+
+// [GOZ]: Each animated object's animation time and displacement at the previous and current simulation steps
+typedef struct {
+	bool valid; // False until the object's first step
+	float elapsedTime[2];
+	vec4 displacement[2];
+} AnimState;
+
+AnimState animStates[maxObjects];
+
+// [GOZ]: Changed whenever a different object takes a place in sceneObjs, so the render thread knows
+unsigned int objectSerials[maxObjects];
+unsigned int nextSerial = 1;
+
+// [GOZ]: Poses of each animated object at the last two animation LOD sample times, see animatedPose
+typedef struct {
+	unsigned int serial; // The objectSerials entry the poses are for, or 0 if there are none yet
+	int interval; // Frames between the two poses
+	long long sample; // poses[0] is at sample * interval frames, poses[1] at (sample + 1) * interval
+	vector<mat4> poses[2];
+} AnimPoseCache;
+
+AnimPoseCache poseCaches[maxObjects];
+
+// Forget the animation state for an object, e.g. when a different object takes its place in sceneObjs.
+// Its cached poses are left to the render thread, which sees the new serial.
+static void clearAnimState(int i) {
+	animStates[i].valid = false;
+	objectSerials[i] = nextSerial++;
+}
+
+//------Simulation and render threads -------------------------------------------
+//
+// [GOZ]: Input, the mouse tools and animation run on a simulation thread, one frame ahead of the GLUT
+// thread, which only draws. The GLUT callbacks post commands for the simulation thread to run at the
+// start of its next frame. Each frame it fills in a snapshot of the scene, which display() swaps for the
+// one it has just drawn. Once the simulation thread has started, the scene (sceneObjs, the camera,
+// frameClock, animStates and the mouse tools) belongs to it, and the render thread only reads snapshots.
+
+typedef struct {
+	int nObjects;
+	SceneObject objs[maxObjects];	// As sceneObjs, with animated objects moved to where they are this frame
+	float elapsedTime[maxObjects];	// Each animated object's animation time this frame
+	unsigned int serials[maxObjects];	// See objectSerials
+	float viewDist, camRotSidewaysDeg, camRotUpAndOverDeg;
+	float lightReachFraction;
+	int mouseX, mouseY;
+	double inputTime;	// When the oldest input first shown in this frame was posted (see inputClockMs), or -1
+} SceneSnapshot;
+
+SceneSnapshot snapshots[2];
+int renderSnapshot = 0; // The snapshot display() is drawing. The simulation thread fills in the other.
+const SceneSnapshot* renderScene = &snapshots[0];
+
+mutex simLock; // Guards the commands and the flags below
+condition_variable simWake;
+deque<function<void()> > simCommands;
+bool frameRequested = false; // display() has taken the last snapshot, so the next can be made
+bool snapshotReady = false; // The simulation thread has made the next snapshot
+bool simStop = false; // Set by stopSimulation to end the simulation thread
+thread simThread;
+double pendingInputTime = -1; // When the oldest input not yet run was posted, or -1
+bool lowLatency = false; // Set with --low-latency, see the Latency section
+
+chrono::steady_clock::time_point inputClockStart = chrono::steady_clock::now();
+
+// Milliseconds since the program started, the clock input events and latency are measured with
+double inputClockMs() {
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - inputClockStart).count();
+}
+
+// Run cmd on the simulation thread at the start of its next frame
+static void postToSim(const function<void()>& cmd) {
+	lock_guard<mutex> guard(simLock);
+	simCommands.push_back(cmd);
+}
+
+//------Input recording and replay -------------------------------------------------
+//
+// [GOZ]: Mouse, keyboard and menu input from the GLUT callbacks is posted to the simulation thread as
+// InputEvents (see inputlog.h). With --record=FILE they are also written to a log, tagged with the
+// simulation frame they run in, along with each frame's clock time. --replay=FILE runs a log's events in
+// the same frames instead of live input, with the recorded random seed, window size and frame times, then
+// reports the frame times and exits. Every event records the object that was under the mouse when it was
+// posted (its last argument), which menus and clicks use instead of mouseObj, as display may have moved
+// on by the time the simulation runs them. Resizing the window during a recording isn't recorded.
+
+enum { INPUT_CLICK = 'c', INPUT_MOVE = 'p', INPUT_DRAG = 'd', INPUT_KEY = 'k', INPUT_MENU = 'm' };
+enum { MENU_OBJECT, MENU_MATERIAL, MENU_TEXTURE, MENU_GROUND, MENU_SAVE, MENU_LOAD, MENU_LIGHT, MENU_MAIN };
+
+char recordFile[256] = "", replayFile[256] = ""; // Set with --record=FILE and --replay=FILE
+const double replayFrameTime = 1.0 / 60; // Seconds per frame when replaying a frame with no recorded time
+unsigned int randomSeed; // Set with --seed=N, otherwise from the time
+InputLog inputLog;
+bool recording = false, replaying = false;
+int simFrame = 0; // The simulation frame posted input runs in, guarded by simLock
+FrameStats frameStats; // Frame times while recording or replaying
+atomic<bool> replayDone(false); // The simulation has reached the end of the replayed log
+int inputMouseObj = -1; // The object under the mouse when the input being run was posted, see runInput
+
+static void runInput(const InputEvent& e); // After the menus, which it calls
+
+// Post an input event to the simulation thread, recording it if --record was given
+static void postInput(char type, int a0 = 0, int a1 = 0, int a2 = 0) {
+	if(replaying) return; // Live input is ignored while replaying
+	InputEvent e = { 0, inputClockMs(), type, { a0, a1, a2, mouseObj } };
+	lock_guard<mutex> guard(simLock);
+	e.frame = simFrame;
+	if(type != INPUT_MOVE && pendingInputTime < 0) pendingInputTime = e.time; // Moving without a button shows nothing
+	if(recording) inputLog.write(e);
+	simCommands.push_back([e]() { runInput(e); });
+}
+
+// A GLUT menu callback that runs menu number `menu` (see runInput) on the simulation thread
+template<int menu> static void simMenu(int id) {
+	postInput(INPUT_MENU, menu, id);
+}
+
+// Called at exit: finish the log being recorded, and report frame times
+static void finishInputLog() {
+	if(recording) {
+		lock_guard<mutex> guard(simLock);
+		inputLog.close(simFrame);
+		printf("Recorded input to %s\n", recordFile);
+	}
+	if(recording || replaying) frameStats.report(stdout);
+}
+
+// Whether a replayed event can be run, so a damaged or edited log can't index past menuFns in runInput
+static bool validInput(const InputEvent& e) {
+	switch(e.type) {
+		case INPUT_CLICK: case INPUT_MOVE: case INPUT_DRAG: case INPUT_KEY:
+			return true;
+		case INPUT_MENU:
+			return e.args[0] >= 0 && e.args[0] <= MENU_MAIN;
+	}
+	return false;
+}
+
+// Set up --record or --replay, before the window is created as a replay sets its size
+void startInputLog() {
+	if(replayFile[0] != '\0') {
+		if(!inputLog.read(replayFile, validInput)) {
+			printf("Error reading input log: %s\n", replayFile);
+			exit(1);
+		}
+		replaying = true;
+		randomSeed = inputLog.seed;
+		windowWidth = inputLog.width;
+		windowHeight = inputLog.height;
+		printf("Replaying %s, %d frames\n", replayFile, inputLog.endFrame);
+	} else if(recordFile[0] != '\0') {
+		if(!inputLog.create(recordFile, randomSeed, windowWidth, windowHeight)) {
+			printf("Error writing input log: %s\n", recordFile);
+			exit(1);
+		}
+		recording = true;
+	}
+	atexit(finishInputLog);
+}
 	
+//------Resource budgets ------------------------------------------------
+//
+// [GOZ]: Meshes and textures are loaded the first time they are drawn, and then kept until the memory
+// is needed. Each is reference counted by the scene objects using it, and when over budget the least
+// recently used unreferenced ones are evicted. An evicted resource is reloaded when next drawn.
+// Texture layers are reserved up front, so the VRAM budget left after them is what meshes can use,
+// unless the array is sparse, in which case each texture counts its loaded mip levels like a mesh.
+// Impostor atlases are also reserved up front.
+
+size_t vramBudget = (size_t)256 << 20; // In bytes, set with --vram-budget=MB
+size_t ramBudget = (size_t)512 << 20; // In bytes, set with --ram-budget=MB
+
+typedef struct {
+	size_t vramBytes, ramBytes; // Memory held by the resource, 0 when it isn't resident
+	int refs; // The number of scene objects using the resource
+	int lastUsed; // The frame in which the resource was last drawn
+} Residency;
+
+Residency meshRes[numMeshes], texRes[numTextures];
+int resourceFrame = 0; // Frame counter for lastUsed
+int meshLoads = 0, meshEvictions = 0, texLoads = 0, texEvictions = 0;
+size_t importedMeshBytes = 0, convertedMeshBytes = 0; // Imported scenes' memory, and what was kept of it
+int animKeysBefore = 0, animKeysAfter = 0; // Animation keys loaded, before and after reduction
+
+size_t totalBytes(Residency* res, int n, bool vram);
+static void commitTexLevel(int slot, int level, bool commit);
+static void releaseTexTail(int slot);
+
+int texLevelSize(int level) { return max(1, texArraySize >> level); }
+
+// The memory used by one mip level of one layer of the texture array. Sparse arrays are RGBA.
+size_t texLevelBytes(int level) { return (size_t)texLevelSize(level) * texLevelSize(level) * (sparseTextures ? 4 : 3); }
+
+// The memory used by one layer of the texture array, including its mip levels
+size_t texLayerBytes() {
+	size_t bytes = 0;
+	for(int level=0; level < numTexLevels; level++) bytes += texLevelBytes(level);
+	return bytes;
+}
+
+// The VRAM used by textures: all the layers, or just the levels loaded if the array is sparse
+size_t texVramBytes() {
+	return sparseTextures ? totalBytes(texRes, numTextures, true) : numTexSlots * texLayerBytes();
+}
+
+// The VRAM used by the impostor atlases: texture coordinates and coverage as RGBA16F, normal and depth as RGBA8
+size_t impostorVramBytes() {
+	if(impostorSize <= 0) return 0;
+	size_t atlasSize = impostorGrid * impostorCell;
+	return numImpostorSlots * atlasSize * atlasSize * (8 + 4);
+}
+
+// Approximate CPU memory held by an imported scene, from the arrays assimp allocates for it.
+// Only used for reporting, as the scene is released once the mesh is loaded.
+size_t sceneBytes(const aiScene* scene) {
+	size_t bytes = sizeof(aiScene);
+	for(unsigned int m=0; m < scene->mNumMeshes; m++) {
+		aiMesh* mesh = scene->mMeshes[m];
+		int nArrays = (mesh->mVertices != NULL) + (mesh->mNormals != NULL) + (mesh->mTangents != NULL) +
+				(mesh->mBitangents != NULL);
+		for(int t=0; t < AI_MAX_NUMBER_OF_TEXTURECOORDS; t++)
+			nArrays += (mesh->mTextureCoords[t] != NULL);
+		bytes += sizeof(aiMesh) + sizeof(aiVector3D) * nArrays * mesh->mNumVertices;
+		bytes += (sizeof(aiFace) + 3 * sizeof(unsigned int)) * mesh->mNumFaces;
+		for(unsigned int b=0; b < mesh->mNumBones; b++)
+			bytes += sizeof(aiBone) + sizeof(aiVertexWeight) * mesh->mBones[b]->mNumWeights;
+	}
+	for(unsigned int a=0; a < scene->mNumAnimations; a++) {
+		aiAnimation* anim = scene->mAnimations[a];
+		for(unsigned int c=0; c < anim->mNumChannels; c++)
+			bytes += sizeof(aiNodeAnim) + sizeof(aiVectorKey) * anim->mChannels[c]->mNumPositionKeys +
+					sizeof(aiQuatKey) * anim->mChannels[c]->mNumRotationKeys;
+	}
+	return bytes;
+}
+
+// Count how many scene objects use each mesh and texture. Called at the start of each frame.
+void countResourceRefs() {
+	for(int i=0; i < numMeshes; i++) meshRes[i].refs = 0;
+	for(int i=0; i < numTextures; i++) texRes[i].refs = 0;
+	for(int i=0; i < renderScene->nObjects; i++) {
+		meshRes[renderScene->objs[i].meshId].refs++;
+		texRes[renderScene->objs[i].texId].refs++;
+	}
+}
+
+// Find the least recently used resource holding VRAM (or RAM), or -1 if there is none.
+// Referenced resources are only considered if allowReferenced is true.
+int leastRecentlyUsed(Residency* res, int n, bool vram, bool allowReferenced) {
+	int lru = -1;
+	for(int i=0; i < n; i++) {
+		if((vram ? res[i].vramBytes : res[i].ramBytes) == 0) continue;
+		if(res[i].refs > 0 && !allowReferenced) continue;
+		if(lru < 0 || res[i].lastUsed < res[lru].lastUsed) lru = i;
+	}
+	return lru;
+}
+
+size_t totalBytes(Residency* res, int n, bool vram) {
+	size_t total = 0;
+	for(int i=0; i < n; i++) total += vram ? res[i].vramBytes : res[i].ramBytes;
+	return total;
+}
+
+// Release a mesh's buffers and data. Its VAO ID is replaced by a fresh one for the reload.
+void evictMesh(int i) {
+	glDeleteBuffers(4, meshBuffers[i]); CheckError();
+	memset(meshBuffers[i], 0, sizeof(meshBuffers[i])); // Meshes in the shared buffers don't have their own
+	glDeleteVertexArrays(1, &vaoIDs[i]);
+	glGenVertexArrays(1, &vaoIDs[i]); CheckError();
+
+	if(meshes[i]->baseVertex >= 0) {
+		freeRange(&sharedVertices, meshes[i]->baseVertex, meshes[i]->numVertices);
+		freeRange(&sharedIndices, meshes[i]->firstIndex, meshes[i]->numFaces * 3);
+	}
+	delete meshes[i];
+	meshes[i] = NULL;
+	meshRes[i].vramBytes = meshRes[i].ramBytes = 0;
+	meshEvictions++;
+}
+
+// Free a texture's layer in the array. Its rgbData is kept (if still resident) for a quick reload.
+void evictTextureLayer(int i) {
+	for(int level = texMinLevel[i]; level < sparseLevels; level++)
+		commitTexLevel(texSlots[i], level, false);
+	releaseTexTail(texSlots[i]);
+	slotTextures[texSlots[i]] = -1;
+	texSlots[i] = -1;
+	texRes[i].vramBytes = 0;
+	texEvictions++;
+}
+
+void evictTextureData(int i) {
+	free(textures[i]->rgbData);
+	free(textures[i]);
+	textures[i] = NULL;
+	vector<GLubyte>().swap(texMips[i]);
+	texRes[i].ramBytes = 0;
+}
+
+// Evict unreferenced resources, least recently used first, until both budgets are met or nothing
+// unreferenced is left. Called at the end of each frame.
+void enforceBudgets() {
+	size_t vramUsed = texVramBytes() + impostorVramBytes() + totalBytes(meshRes, numMeshes, true);
+	while(vramUsed > vramBudget) {
+		int m = leastRecentlyUsed(meshRes, numMeshes, true, false);
+		int t = sparseTextures ? leastRecentlyUsed(texRes, numTextures, true, false) : -1;
+		if(m < 0 && t < 0) break;
+		if(t < 0 || (m >= 0 && meshRes[m].lastUsed < texRes[t].lastUsed)) {
+			vramUsed -= meshRes[m].vramBytes;
+			evictMesh(m);
+		} else {
+			vramUsed -= texRes[t].vramBytes;
+			evictTextureLayer(t);
+		}
+	}
+
+	size_t ramUsed = totalBytes(meshRes, numMeshes, false) + totalBytes(texRes, numTextures, false);
+	while(ramUsed > ramBudget) {
+		int m = leastRecentlyUsed(meshRes, numMeshes, false, false);
+		int t = leastRecentlyUsed(texRes, numTextures, false, false);
+		if(m < 0 && t < 0) break;
+		if(t < 0 || (m >= 0 && meshRes[m].lastUsed < texRes[t].lastUsed)) {
+			ramUsed -= meshRes[m].ramBytes;
+			evictMesh(m);
+		} else {
+			ramUsed -= texRes[t].ramBytes;
+			evictTextureData(t);
+		}
+	}
+}
+
+// Find a free layer in the texture array, evicting the least recently used texture if they are all
+// in use. Unreferenced textures go first, but if every layer is referenced one of those must go.
+int acquireTextureSlot() {
+	for(int s=0; s < numTexSlots; s++)
+		if(slotTextures[s] < 0) return s;
+
+	int i = leastRecentlyUsed(texRes, numTextures, true, false);
+	if(i < 0) i = leastRecentlyUsed(texRes, numTextures, true, true);
+	int s = texSlots[i];
+	evictTextureLayer(i);
+	return s;
+}
+
+static void printResidency() {
+	int nMeshes = 0, nLayers = 0, nTexData = 0;
+	for(int i=0; i < numMeshes; i++) nMeshes += (meshes[i] != NULL);
+	for(int i=0; i < numTextures; i++) { nLayers += (texSlots[i] >= 0); nTexData += (textures[i] != NULL); }
+
+	size_t meshVram = totalBytes(meshRes, numMeshes, true), texVram = texVramBytes();
+	size_t meshRam = totalBytes(meshRes, numMeshes, false), texRam = totalBytes(texRes, numTextures, false);
+	printf("Meshes: %d resident, %.1f MB VRAM, %.1f MB RAM, %d loads, %d evictions\n",
+			nMeshes, meshVram / 1048576.0, meshRam / 1048576.0, meshLoads, meshEvictions);
+	printf("Textures: %d of %d layers used (%.1f MB VRAM), %d in RAM (%.1f MB), %d loads, %d evictions\n",
+			nLayers, numTexSlots, texVram / 1048576.0, nTexData, texRam / 1048576.0, texLoads, texEvictions);
+	printf("Texture streaming: %d mip levels uploaded, %d dropped%s\n", texLevelUploads, texLevelDrops,
+			sparseTextures ? ", sparse array" : "");
+	if(impostorSize > 0) {
+		int nAtlases = 0;
+		for(int s=0; s < numImpostorSlots; s++) nAtlases += (slotImpostors[s] >= 0);
+		printf("Impostors: %d of %d atlases baked (%.1f MB VRAM), %d bakes\n",
+				nAtlases, numImpostorSlots, impostorVramBytes() / 1048576.0, impostorBakes);
+	}
+	printf("Mesh loads kept %.1f of %.1f MB of imported scenes, and %d of %d animation keys\n",
+			convertedMeshBytes / 1048576.0, importedMeshBytes / 1048576.0, animKeysAfter, animKeysBefore);
+	printf("Budgets: %.1f of %.0f MB VRAM, %.1f of %.0f MB RAM\n",
+			(meshVram + texVram + impostorVramBytes()) / 1048576.0, vramBudget / 1048576.0,
+			(meshRam + texRam) / 1048576.0, ramBudget / 1048576.0);
+}
+
+
 //------------------------------------------------------------
-// Loads a texture by number, and binds it for later use.  
-void loadTextureIfNotAlreadyLoaded(int i) {
-	if(textures[i] != NULL) return; // The texture is already loaded.
+// [GOZ]: Make the bound array sparse, with a layer for every texture and no memory committed yet.
+// Returns false if the driver can't make RGBA8 arrays sparse.
+static bool initSparseTextureArray() {
+	GLint nPageSizes = 0;
+	glGetInternalformativ(GL_TEXTURE_2D_ARRAY, GL_RGBA8, GL_NUM_VIRTUAL_PAGE_SIZES_ARB, 1, &nPageSizes);
+	if(nPageSizes <= 0) return false;
+
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_SPARSE_ARB, GL_TRUE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_VIRTUAL_PAGE_SIZE_INDEX_ARB, 0);
+	glTexStorage3D(GL_TEXTURE_2D_ARRAY, numTexLevels, GL_RGBA8, texArraySize, texArraySize, numTextures);
+	if(glGetError() != GL_NO_ERROR) {
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_SPARSE_ARB, GL_FALSE);
+		return false;
+	}
+	glGetTexParameteriv(GL_TEXTURE_2D_ARRAY, GL_NUM_SPARSE_LEVELS_ARB, &sparseLevels);
+	numTexSlots = numTextures;
+	return true;
+}
+
+// [GOZ]: Round texArraySize down to a power of two and count its mip levels
+void initTexLevels() {
+	while(texArraySize & (texArraySize - 1)) texArraySize &= texArraySize - 1;
+	for(numTexLevels = 1; texLevelSize(numTexLevels - 1) > 1; numTexLevels++) ;
+}
+
+// [GOZ]: Allocates storage for every layer and mip level of the texture array. Layers are given to
+// textures by loadTextureIfNotAlreadyLoaded as they are first used.
+void initTextureArray() {
+	initTexLevels();
+	for(int i=0; i < numTextures; i++) {
+		texSlots[i] = slotTextures[i] = texPlain[i] = -1;
+		texWantLevel[i] = numTexLevels;
+	}
+
+	glGenTextures(1, &textureArrayID); CheckError();
+	glBindTexture(GL_TEXTURE_2D_ARRAY, textureArrayID); CheckError();
+
+	sparseTextures = GLEW_ARB_sparse_texture && initSparseTextureArray();
+	if(!sparseTextures) {
+		// [GOZ]: Use at most half the VRAM budget for texture layers, leaving the rest for meshes
+		numTexSlots = min(numTextures, max(1, (int)(vramBudget / 2 / texLayerBytes())));
+		sparseLevels = numTexLevels;
+		for(int level=0; level < numTexLevels; level++) {
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGB8, texLevelSize(level), texLevelSize(level),
+					numTexSlots, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL); CheckError();
+		}
+	}
+
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT); CheckError();
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT); CheckError();
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR); CheckError();
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR); CheckError();
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, numTexLevels - 1); CheckError();
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // The smallest levels have rows of 3 or 6 bytes
+	labelObject(GL_TEXTURE, textureArrayID, "Texture array");
+
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0); CheckError();
+
+	// Each layer's finest loaded level, as a texture buffer
+	glGenBuffers(1, &layerMinLevelBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, layerMinLevelBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(layerMinLevels), layerMinLevels, GL_DYNAMIC_DRAW);
+	glGenTextures(1, &layerMinLevelTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, layerMinLevelTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, layerMinLevelBuffer);
+	labelObject(GL_BUFFER, layerMinLevelBuffer, "Layer min levels");
+	labelObject(GL_TEXTURE, layerMinLevelTexture, "Layer min levels");
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0); CheckError();
+
+	if(sparseTextures) printf("Textures are %d x %d in a sparse array\n", texArraySize, texArraySize);
+}
+
+// Where mip level `level` (1 or more) starts in texMips
+static size_t texMipOffset(int level) {
+	size_t offset = 0;
+	for(int l=1; l < level; l++) offset += (size_t)texLevelSize(l) * texLevelSize(l) * 3;
+	return offset;
+}
+
+// A texture's RGB data for a mip level, which must be in memory
+static const GLubyte* texLevelData(int i, int level) {
+	return level == 0 ? textures[i]->rgbData : &texMips[i][texMipOffset(level)];
+}
+
+// [GOZ]: Texture files are decoded on workerPool: read (see texdecode.h), resized to the array's size,
+// mipmapped and checked for being a plain colour. The finished buffers wait in texDecoded for the GL
+// thread, which installs them at the start of each frame, or straight away when it needs one. Textures
+// are queued when the program starts (see prefetchTextures), so most are ready before they are first drawn.
+typedef struct {
+	texture* tex;
+	vector<GLubyte> mips; // As texMips
+	bool plain;
+	vec3 plainColor;
+} DecodedTexture;
+
+enum { DECODE_NONE, DECODE_QUEUED, DECODE_RUNNING, DECODE_DONE };
+mutex texDecodeLock;
+condition_variable texDecodeDone;
+int texDecodeState[numTextures]; // Guarded by texDecodeLock, like texDecoded
+DecodedTexture* texDecoded[numTextures]; // Finished decodes the GL thread hasn't installed yet
+bool textureBenchmark = false; // Set with --texture-benchmark, see benchmarkTextureDecode
+atomic<bool> texDecodeStop(false); // Set at exit, so queued decodes do nothing, see stopWorkerPool
+
+// Mip levels 1 and up of a texArraySize x texArraySize texture, laid out as in texMips
+static void makeTexMips(const texture* t, vector<GLubyte>* mips) {
+	mips->resize(texMipOffset(numTexLevels));
+	for(int level=1; level < numTexLevels; level++) {
+		const GLubyte* src = level == 1 ? t->rgbData : &(*mips)[texMipOffset(level - 1)];
+		halveImage(src, texLevelSize(level - 1), &(*mips)[texMipOffset(level)]);
+	}
+}
+
+// Decode a texture's file. Only reads settings that are fixed by init, so can run on any thread.
+static DecodedTexture* decodeTexture(int i) {
+	char fileName[220];
+	sprintf(fileName, "%s/texture%d.bmp", dataDir, i);
+	DecodedTexture* d = new DecodedTexture();
+	d->tex = decodeBMP(fileName);
+	if(d->tex == NULL) d->tex = loadTextureNum(i); // Other kinds of BMP go through LoadDIBitmap
+	if(d->tex->width != texArraySize || d->tex->height != texArraySize)
+		resizeTexture(d->tex, texArraySize, texArraySize);	// [GOZ]: Every layer has the same size
+
+	// [GOZ]: The mip levels are made here rather than by glGenerateMipmap, so they can be uploaded one at a time
+	makeTexMips(d->tex, &d->mips);
+
+	const GLubyte *rgb = d->tex->rgbData;
+	size_t bytes = (size_t)texArraySize * texArraySize * 3;
+	d->plain = true;
+	for(size_t p=3; p < bytes && d->plain; p++)
+		if(rgb[p] != rgb[p % 3]) d->plain = false;
+	d->plainColor = vec3(rgb[0] / 255.0, rgb[1] / 255.0, rgb[2] / 255.0);
+	return d;
+}
+
+// Stop workerPool at exit, before the globals its tasks use (such as texDecodeLock) are destroyed.
+// Queued decodes are skipped, and the workers finish what they are running and are joined.
+static void stopWorkerPool() {
+	if(workerPool->onWorker()) return; // exit() on a worker, which can't wait for itself
+	texDecodeStop = true;
+	delete workerPool;
+	workerPool = NULL;
+}
+
+// Create workerPool, stopping it at exit
+void startWorkerPool() {
+	workerPool = new ThreadPool();
+	atexit(stopWorkerPool);
+}
+
+// Queue a texture to be decoded on workerPool, unless its data is in memory or already on its way.
+// Returns whether it was queued.
+bool queueTextureDecode(int i) {
+	{
+		lock_guard<mutex> guard(texDecodeLock);
+		if(textures[i] != NULL || texDecodeState[i] != DECODE_NONE) return false;
+		texDecodeState[i] = DECODE_QUEUED;
+	}
+	workerPool->run([i]() {
+		if(texDecodeStop) return;
+		{
+			lock_guard<mutex> guard(texDecodeLock);
+			if(texDecodeState[i] != DECODE_QUEUED) return; // The GL thread decoded it itself
+			texDecodeState[i] = DECODE_RUNNING;
+		}
+		DecodedTexture* d = decodeTexture(i);
+		lock_guard<mutex> guard(texDecodeLock);
+		texDecoded[i] = d;
+		texDecodeState[i] = DECODE_DONE;
+		texDecodeDone.notify_all();
+	});
+	return true;
+}
+
+// Queue decodes for the scene's textures, then the rest in order, while what they will take fits in half
+// the RAM budget along with the textures already in memory. The other half is left for meshes, so that
+// enforceBudgets doesn't evict decoded textures that haven't been drawn yet, only to decode them again
+// when they are. Textures that don't fit are decoded when first drawn, see loadTextureData.
+void prefetchTextures() {
+	size_t dataBytes = (size_t)texArraySize * texArraySize * 3 + texMipOffset(numTexLevels); // As in installTexture
+	size_t bytes = totalBytes(texRes, numTextures, false);
+	vector<int> order;
+	for(int i=0; i < nObjects; i++) order.push_back(sceneObjs[i].texId);
+	for(int i=0; i < numTextures; i++) order.push_back(i);
+	for(size_t k=0; k < order.size() && bytes + dataBytes <= ramBudget / 2; k++)
+		if(queueTextureDecode(order[k])) bytes += dataBytes;
+}
+
+// Make a decoded texture's data the texture's, on the GL thread
+static void installTexture(int i, DecodedTexture* d) {
+	textures[i] = d->tex;
+	texMips[i].swap(d->mips);
+	texRes[i].ramBytes = (size_t)texArraySize * texArraySize * 3 + texMips[i].size();
+	texLoads++;
+	if(texPlain[i] < 0) {
+		texPlain[i] = d->plain;
+		texPlainColor[i] = d->plainColor;
+	}
+	delete d;
+}
 
-	textures[i] = loadTextureNum(i); CheckError();
+// Install the textures that have finished decoding. Called at the start of each frame.
+void collectDecodedTextures() {
+	vector<pair<int, DecodedTexture*> > done;
+	{
+		lock_guard<mutex> guard(texDecodeLock);
+		for(int i=0; i < numTextures; i++) {
+			if(texDecodeState[i] != DECODE_DONE) continue;
+			done.push_back(make_pair(i, texDecoded[i]));
+			texDecoded[i] = NULL;
+			texDecodeState[i] = DECODE_NONE;
+		}
+	}
+	for(size_t k=0; k < done.size(); k++) installTexture(done[k].first, done[k].second);
+}
+
+// Makes sure a texture's data is in memory, and notes whether it is a plain colour. Waits for its decode
+// if one is running, and otherwise decodes it here rather than wait for a worker to get to it.
+void loadTextureData(int i) {
+	if(textures[i] != NULL) return;
+
+	DecodedTexture* d = NULL;
+	{
+		unique_lock<mutex> waitLock(texDecodeLock);
+		if(texDecodeState[i] == DECODE_RUNNING || texDecodeState[i] == DECODE_DONE) {
+			texDecodeDone.wait(waitLock, [i]() { return texDecodeState[i] == DECODE_DONE; });
+			d = texDecoded[i];
+			texDecoded[i] = NULL;
+		}
+		texDecodeState[i] = DECODE_NONE; // A queued decode finds this and does nothing
+	}
+	if(d == NULL) d = decodeTexture(i);
+	installTexture(i, d);
+}
+
+// [GOZ]: --texture-benchmark. Times reading every texture file, resizing it and making its mip levels, the
+// old way (one at a time with LoadDIBitmap) and with decodeTexture on workerPool. Each is run twice and
+// the second run is reported, so that both read the files from the page cache. Exits when done.
+void benchmarkTextureDecode() {
+	initTexLevels();
+	startWorkerPool();
+	double oldMs = 0.0, newMs = 0.0;
+	for(int run=0; run < 2; run++) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for(int i=0; i < numTextures; i++) {
+			texture* t = loadTextureNum(i);
+			if(t->width != texArraySize || t->height != texArraySize) resizeTexture(t, texArraySize, texArraySize);
+			vector<GLubyte> mips;
+			makeTexMips(t, &mips);
+			free(t->rgbData);
+			free(t);
+		}
+		chrono::steady_clock::time_point middle = chrono::steady_clock::now();
+		vector<DecodedTexture*> decoded(numTextures);
+		workerPool->parallelFor(numTextures, [&](int i) { decoded[i] = decodeTexture(i); });
+		chrono::steady_clock::time_point end = chrono::steady_clock::now();
+		for(int i=0; i < numTextures; i++) {
+			free(decoded[i]->tex->rgbData);
+			free(decoded[i]->tex);
+			delete decoded[i];
+		}
+		oldMs = chrono::duration<double, milli>(middle - start).count();
+		newMs = chrono::duration<double, milli>(end - middle).count();
+	}
+	printf("Decoding %d textures at %d x %d: LoadDIBitmap %.1f ms, decodeTexture on %d threads %.1f ms (%.1fx)\n",
+			numTextures, texArraySize, texArraySize, oldMs, workerPool->size() + 1, newMs, oldMs / newMs);
+	exit(EXIT_SUCCESS);
+}
+
+// Whether a texture is a single plain colour, so it can be drawn without sampling. Reads the texture
+// the first time it is asked about.
+bool isPlainTexture(int i) {
+	texRes[i].lastUsed = resourceFrame;
+	if(texPlain[i] < 0) loadTextureData(i);
+	return texPlain[i] == 1;
+}
+
+// Commit or release the memory for one mip level of a layer of a sparse array. The mip tail (levels
+// sparseLevels and up) belongs to the layer rather than to any one level: it is committed as a whole
+// before the first upload into any of its levels, coarsest first, as writes to uncommitted pages are
+// discarded. Releasing a tail level does nothing, the tail is only released with the layer, see
+// evictTextureLayer.
+static void commitTexLevel(int slot, int level, bool commit) {
+	if(!sparseTextures) return;
+	if(level >= sparseLevels) {
+		if(!commit || layerTailCommitted[slot]) return;
+		level = sparseLevels;
+		layerTailCommitted[slot] = true;
+	}
+	glTexPageCommitmentARB(GL_TEXTURE_2D_ARRAY, level, 0, 0, slot, texLevelSize(level), texLevelSize(level), 1,
+			commit); CheckError();
+}
+
+// Release a layer's mip tail, when its texture is evicted
+static void releaseTexTail(int slot) {
+	if(!sparseTextures || !layerTailCommitted[slot]) return;
+	glTexPageCommitmentARB(GL_TEXTURE_2D_ARRAY, sparseLevels, 0, 0, slot, texLevelSize(sparseLevels),
+			texLevelSize(sparseLevels), 1, GL_FALSE); CheckError();
+	layerTailCommitted[slot] = false;
+}
+
+// Upload the next finer mip level of a texture's layer. The texture array must be bound.
+static void uploadTexLevel(int i) {
+	int level = texMinLevel[i] - 1, slot = texSlots[i];
+	loadTextureData(i);
+	commitTexLevel(slot, level, true);
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, slot, texLevelSize(level), texLevelSize(level), 1,
+			GL_RGB, GL_UNSIGNED_BYTE, texLevelData(i, level)); CheckError();
+
+	texMinLevel[i] = level;
+	texRes[i].vramBytes += texLevelBytes(level);
+	layerMinLevels[slot] = level;
+	layerMinLevelsChanged = true;
+	texLevelUploads++;
+}
+
+// Drop the finest loaded mip level of a texture's layer, giving back its memory
+static void dropTexLevel(int i) {
+	int level = texMinLevel[i];
+	commitTexLevel(texSlots[i], level, false);
+	texMinLevel[i] = level + 1;
+	texRes[i].vramBytes -= texLevelBytes(level);
+	layerMinLevels[texSlots[i]] = level + 1;
+	layerMinLevelsChanged = true;
+	texLevelDrops++;
+}
+
+// Loads a texture by number into a layer of the texture array, reading the file if its data
+// isn't still in memory. Returns the layer.
+// [GOZ]: Only the coarse mip levels are loaded, streamTextures loads finer ones when they're needed.
+int loadTextureIfNotAlreadyLoaded(int i) {
+	texRes[i].lastUsed = resourceFrame;
+	if(texSlots[i] >= 0) return texSlots[i]; // The texture is already loaded.
+
+	loadTextureData(i);
+
+	int slot = acquireTextureSlot();
 	glActiveTexture(GL_TEXTURE0); CheckError();
+	glBindTexture(GL_TEXTURE_2D_ARRAY, textureArrayID); CheckError();
+
+	texSlots[i] = slot;
+	slotTextures[slot] = i;
+	texMinLevel[i] = numTexLevels;
+	texDropFrames[i] = 0;
+	texRes[i].vramBytes = 0;
+	while(texMinLevel[i] > 0 && texLevelSize(texMinLevel[i] - 1) <= texStreamStartSize) uploadTexLevel(i);
+	if(!sparseTextures) texRes[i].vramBytes = texLayerBytes(); // The whole layer is allocated anyway
+	return slot;
+}
 
-	// Based on: http://www.opengl.org/wiki/Common_Mistakes
-	glBindTexture(GL_TEXTURE_2D, textureIDs[i]);
-	CheckError();
+// Note that an object using texture i with texture scale texScale covers a circle of radius `pixels` on
+// screen (0 if it is off screen), and load the texture's layer if it isn't loaded. The texture coordinates
+// span about 2 * texScale repeats of the texture across an object, see fScene.glsl.
+void requestTextureLevel(int i, float texScale, float pixels) {
+	loadTextureIfNotAlreadyLoaded(i);
+	if(pixels <= 0.0) return;
+	float texelsPerPixel = texArraySize * texScale / pixels;
+	int level = texelsPerPixel <= 1.0 ? 0 : min(numTexLevels - 1, (int)floor(log2(texelsPerPixel)));
+	texWantLevel[i] = min(texWantLevel[i], level);
+}
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, textures[i]->width, textures[i]->height,
-			0, GL_RGB, GL_UNSIGNED_BYTE, textures[i]->rgbData); CheckError();
-	glGenerateMipmap(GL_TEXTURE_2D); CheckError();
+// [GOZ]: Load finer mip levels for the textures this frame's objects need, the textures furthest from
+// what they need first, until texUploadBudget bytes have been uploaded (but always at least one level,
+// so that large levels still arrive). With a sparse array, levels that have gone unneeded for
+// texDropDelay frames are dropped again. Called each frame, after requestTextureLevel for each object.
+void streamTextures() {
+	pushDebugGroup("Texture streaming");
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, textureArrayID); CheckError();
+
+	for(int i=0; sparseTextures && i < numTextures; i++) {
+		if(texSlots[i] < 0) continue;
+		if(texWantLevel[i] <= texMinLevel[i] || texLevelSize(texMinLevel[i]) <= texStreamStartSize)
+			texDropFrames[i] = 0;
+		else if(++texDropFrames[i] >= texDropDelay) {
+			dropTexLevel(i);
+			texDropFrames[i] = 0;
+		}
+	}
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT); CheckError();
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT); CheckError();
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR); CheckError();
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR); CheckError();
+	size_t uploaded = 0;
+	for(;;) {
+		int best = -1;
+		for(int i=0; i < numTextures; i++) {
+			if(texSlots[i] < 0 || texWantLevel[i] >= texMinLevel[i]) continue;
+			if(best < 0 || texMinLevel[i] - texWantLevel[i] > texMinLevel[best] - texWantLevel[best]) best = i;
+		}
+		if(best < 0) break;
+		size_t bytes = texLevelBytes(texMinLevel[best] - 1);
+		if(uploaded > 0 && uploaded + bytes > texUploadBudget) break;
+		uploadTexLevel(best);
+		uploaded += bytes;
+	}
+	for(int i=0; i < numTextures; i++) texWantLevel[i] = numTexLevels;
 
-	glBindTexture(GL_TEXTURE_2D, 0); CheckError(); // Back to default texture
+	if(layerMinLevelsChanged) {
+		glBindBuffer(GL_TEXTURE_BUFFER, layerMinLevelBuffer);
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(layerMinLevels), layerMinLevels);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0); CheckError();
+		layerMinLevelsChanged = false;
+	}
+	popDebugGroup();
 }
 
 
@@ -126,6 +1024,41 @@ void loadTextureIfNotAlreadyLoaded(int i) {
 // format, including vertex positions, normals, and texture coordinates.
 // You shouldn't need to modify this - it's called from drawMesh below.
 
+// [GOZ]: Copy a mesh into ranges of the shared vertex and index buffers, returning false if either
+// is full. The ranges taken are left in sharedBase.
+static int sharedBase[2];
+
+static bool loadSharedMesh(int meshNumber, aiMesh* mesh) {
+	int nVerts = mesh->mNumVertices, nIndices = mesh->mNumFaces * 3;
+	sharedBase[0] = allocRange(&sharedVertices, nVerts);
+	sharedBase[1] = allocRange(&sharedIndices, nIndices);
+	if(sharedBase[0] < 0 || sharedBase[1] < 0) {
+		if(sharedBase[0] >= 0) freeRange(&sharedVertices, sharedBase[0], nVerts);
+		if(sharedBase[1] >= 0) freeRange(&sharedIndices, sharedBase[1], nIndices);
+		printf("Shared mesh buffers are full, mesh %d will be drawn on its own\n", meshNumber);
+		return false;
+	}
+
+	vector<float> vertices(sharedVertexFloats * nVerts);
+	for(int i=0; i < nVerts; i++) {
+		float* v = &vertices[sharedVertexFloats * i];
+		v[0] = mesh->mVertices[i].x; v[1] = mesh->mVertices[i].y; v[2] = mesh->mVertices[i].z;
+		v[3] = mesh->mTextureCoords[0][i].x; v[4] = mesh->mTextureCoords[0][i].y;
+		v[5] = mesh->mNormals[i].x; v[6] = mesh->mNormals[i].y; v[7] = mesh->mNormals[i].z;
+	}
+	vector<GLuint> elements(nIndices);
+	for(GLuint i=0; i < mesh->mNumFaces; i++)
+		for(int j=0; j < 3; j++) elements[i*3+j] = mesh->mFaces[i].mIndices[j];
+
+	glBindBuffer(GL_ARRAY_BUFFER, sharedVertexBuffer);
+	glBufferSubData(GL_ARRAY_BUFFER, sizeof(float)*sharedVertexFloats*sharedBase[0],
+			sizeof(float)*vertices.size(), &vertices[0]);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, sharedIndexBuffer); // Not bound as an element array, that's VAO state
+	glBufferSubData(GL_COPY_WRITE_BUFFER, sizeof(GLuint)*sharedBase[1], sizeof(GLuint)*nIndices, &elements[0]);
+	CheckError();
+	return true;
+}
+
 void loadMeshIfNotAlreadyLoaded(int meshNumber) {
 
 	if(meshNumber>=numMeshes || meshNumber < 0) {
@@ -133,30 +1066,58 @@ void loadMeshIfNotAlreadyLoaded(int meshNumber) {
 		exit(1);
 	}
 
+	meshRes[meshNumber].lastUsed = resourceFrame;
 	if(meshes[meshNumber] != NULL)
 		return; // Already loaded
 
 		// [TFD]: part D.B5, direct from instructions
     const aiScene* scene = loadScene(meshNumber);
-    scenes[meshNumber] = scene;
     aiMesh* mesh = scene->mMeshes[0];
-    meshes[meshNumber] = mesh;
+
+	int nVerts = mesh->mNumVertices;
+	meshRadius[meshNumber] = 0.0;
+	for(int i=0; i < nVerts; i++) {
+		aiVector3D p = mesh->mVertices[i];
+		meshRadius[meshNumber] = max(meshRadius[meshNumber], sqrtf(p.x*p.x + p.y*p.y + p.z*p.z));
+	}
+
+	// [GOZ]: Meshes without bones go in the shared buffers for GPU-driven drawing, if there's room
+	if(gpuDriven && mesh->mNumBones == 0 && loadSharedMesh(meshNumber, mesh)) {
+		MeshData* data = new MeshData();
+		data->numFaces = mesh->mNumFaces;
+		data->numBones = 0;
+		data->numVertices = nVerts;
+		data->baseVertex = sharedBase[0];
+		data->firstIndex = sharedBase[1];
+		meshes[meshNumber] = data;
+
+		size_t keptBytes = sizeof(MeshData);
+		importedMeshBytes += sceneBytes(scene);
+		convertedMeshBytes += keptBytes;
+		aiReleaseImport(scene);
+
+		meshRes[meshNumber].vramBytes = sizeof(float)*sharedVertexFloats*nVerts + sizeof(GLuint)*data->numFaces*3;
+		meshRes[meshNumber].ramBytes = keptBytes;
+		meshLoads++;
+		return;
+	}
 
 	glBindVertexArray( vaoIDs[meshNumber] );
 
 	// Create and initialize a buffer object for positions and texture coordinates, initially empty.
 	// mesh->mTextureCoords[0] has space for up to 3 dimensions, but we only need 2.
-	GLuint buffer[1];
-	glGenBuffers( 1, buffer );
-	glBindBuffer( GL_ARRAY_BUFFER, buffer[0] );
+	// [GOZ]: The buffer IDs are kept in meshBuffers so that evictMesh can delete them.
+	glGenBuffers( 4, meshBuffers[meshNumber] );
+	glBindBuffer( GL_ARRAY_BUFFER, meshBuffers[meshNumber][0] );
 	glBufferData( GL_ARRAY_BUFFER, sizeof(float)*(3+3+3)*mesh->mNumVertices,
 			NULL, GL_STATIC_DRAW );
 
-	int nVerts = mesh->mNumVertices;
 	// Next, we load the position and texCoord data in parts.  
 	glBufferSubData( GL_ARRAY_BUFFER, 0, sizeof(float)*3*nVerts, mesh->mVertices );
 	glBufferSubData( GL_ARRAY_BUFFER, sizeof(float)*3*nVerts, sizeof(float)*3*nVerts, mesh->mTextureCoords[0] );
 	glBufferSubData( GL_ARRAY_BUFFER, sizeof(float)*6*nVerts, sizeof(float)*3*nVerts, mesh->mNormals);
+	labelObject(GL_VERTEX_ARRAY, vaoIDs[meshNumber], "Mesh %d", meshNumber);
+	labelObject(GL_BUFFER, meshBuffers[meshNumber][0], "Mesh %d vertices", meshNumber);
 
 	// Load the element index data
 	GLuint elements[mesh->mNumFaces*3];
@@ -166,10 +1127,9 @@ void loadMeshIfNotAlreadyLoaded(int meshNumber) {
 		elements[i*3+2] = mesh->mFaces[i].mIndices[2];
 	}
 
-	GLuint elementBufferId[1];
-	glGenBuffers(1, elementBufferId);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementBufferId[0]);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshBuffers[meshNumber][1]);
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * mesh->mNumFaces * 3, elements, GL_STATIC_DRAW);
+	labelObject(GL_BUFFER, meshBuffers[meshNumber][1], "Mesh %d indices", meshNumber);
 
 	// vPosition it actually 4D - the conversion sets the fourth dimension (i.e. w) to 1.0         
 	glVertexAttribPointer( vPosition, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0) );
@@ -190,8 +1150,17 @@ void loadMeshIfNotAlreadyLoaded(int meshNumber) {
     GLfloat boneWeights[mesh->mNumVertices][4];
     getBonesAffectingEachVertex(mesh, boneIDs, boneWeights);
 
-    GLuint buffers[2];
-    glGenBuffers( 2, buffers );  // Add two vertex buffer objects
+	// [GOZ]: Sort each vertex's bones by weight, heaviest first, for VARIANT_SKIN_ONE_BONE
+	for(int i=0; i < nVerts; i++) {
+		for(int a=1; a < 4; a++) {
+			for(int b=a; b > 0 && boneWeights[i][b] > boneWeights[i][b-1]; b--) {
+				swap(boneWeights[i][b], boneWeights[i][b-1]);
+				swap(boneIDs[i][b], boneIDs[i][b-1]);
+			}
+		}
+	}
+
+    GLuint *buffers = meshBuffers[meshNumber] + 2;  // Add two vertex buffer objects
 	
     glBindBuffer( GL_ARRAY_BUFFER, buffers[0] ); CheckError();
     glBufferData( GL_ARRAY_BUFFER, sizeof(int)*4*mesh->mNumVertices, boneIDs, GL_STATIC_DRAW ); CheckError();
@@ -202,14 +1171,37 @@ void loadMeshIfNotAlreadyLoaded(int meshNumber) {
     glBufferData( GL_ARRAY_BUFFER, sizeof(float)*4*mesh->mNumVertices, boneWeights, GL_STATIC_DRAW );
     glVertexAttribPointer(vBoneWeights, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
     glEnableVertexAttribArray(vBoneWeights);    CheckError();
-	
+	labelObject(GL_BUFFER, buffers[0], "Mesh %d bone IDs", meshNumber);
+	labelObject(GL_BUFFER, buffers[1], "Mesh %d bone weights", meshNumber);
+
+	// [GOZ]: Keep the face and bone counts and convert the skeleton, then the imported scene can go
+	MeshData* data = new MeshData();
+	data->numFaces = mesh->mNumFaces;
+	data->numBones = mesh->mNumBones;
+	data->numVertices = nVerts;
+	data->baseVertex = data->firstIndex = -1;
+	buildSkeleton(mesh, scene, &data->skeleton);
+	meshes[meshNumber] = data;
+
+	size_t keptBytes = sizeof(MeshData) + skeletonBytes(&data->skeleton);
+	importedMeshBytes += sceneBytes(scene);
+	convertedMeshBytes += keptBytes;
+	animKeysBefore += data->skeleton.keysBefore;
+	animKeysAfter += data->skeleton.keysAfter;
+	aiReleaseImport(scene);
+
+	meshRes[meshNumber].vramBytes = (sizeof(float)*(3+3+3) + sizeof(int)*4 + sizeof(float)*4) * nVerts +
+			sizeof(GLuint) * data->numFaces * 3;
+	meshRes[meshNumber].ramBytes = keptBytes;
+	meshLoads++;
 }
 
 
 // --------------------------------------
-static void mouseClickOrScroll(int button, int state, int x, int y) {
+// [GOZ]: The mouse callbacks post their work to the simulation thread, which owns the tools
+static void mouseClick(int button, int state, int modifiers) {
 	if(button==GLUT_LEFT_BUTTON && state == GLUT_DOWN) {
-		if(glutGetModifiers()!=GLUT_ACTIVE_SHIFT) activateTool(0);
+		if(modifiers!=GLUT_ACTIVE_SHIFT) activateTool(0);
 		else activateTool(2);
 	}
 	else if(button==GLUT_LEFT_BUTTON && state == GLUT_UP) clearTool();
@@ -224,17 +1216,16 @@ static void mouseClickOrScroll(int button, int state, int x, int y) {
 	}
 }
 
+static void mouseClickOrScroll(int button, int state, int x, int y) {
+	postInput(INPUT_CLICK, button, state, glutGetModifiers());	// The modifiers are only valid during the callback
+}
+
 static void mousePassiveMotion(int x, int y) {
-	mouseX=x;
-	mouseY=y;
+	postInput(INPUT_MOVE, x, y);
 }
 
 static void mouseClickMotion(int x, int y) {
-	mouseX=x;
-	mouseY=y;
-
-	doToolUpdateXY();
-	glutPostRedisplay();
+	postInput(INPUT_DRAG, x, y);
 }
 
 mat2 camRotZ() { return rotZ(-camRotSidewaysDeg) * mat2(10.0, 0, 0, -10.0); }
@@ -256,7 +1247,7 @@ static void addObject(int id) {
 	// [GOZ]: PART J. Raycasting to place object where click intersects with world plane.
 	// [GOZ]: Reference: http://www.antongerdelan.net/opengl/raycasting.html
 	mat4 invView = RotateY(-camRotSidewaysDeg) * RotateX(-camRotUpAndOverDeg) * Translate(0.0, 0.0, viewDist);
-	mat4 p = projection;	// [GOZ]: For legibility
+	mat4 p = simProjection;	// [GOZ]: For legibility
 	mat4 invProj = mat4(1.0/p[0][0], 0.0, 0.0, 0.0,		// [GOZ]: Inverse of the projection matrix
 			0.0, 1.0/p[1][1], 0.0, 0.0,
 			0.0, 0.0, 0.0, 1.0/p[2][3],
@@ -301,11 +1292,8 @@ static void addObject(int id) {
 		sceneObjs[nObjects].scale = 0.005;
 	
 	if(id > 55) {
-		if(animationPause == 0){	// [TFD]: if animation is not paused begin animation immediately
-			sceneObjs[nObjects].animStart = glutGet(GLUT_ELAPSED_TIME);
-		} else {			// [TFD]: Else begin animation on resume
-			sceneObjs[nObjects].animStart = animationPause;
-		}
+		// [TFD]: Begin animation immediately, or on resume if paused [GOZ]: simTime stands still while paused
+		sceneObjs[nObjects].animStart = frameClock.simTime;
 		
 		sceneObjs[nObjects].moveSpeed = 1.0;
 		sceneObjs[nObjects].moveDist = 5.0;
@@ -326,104 +1314,990 @@ static void addObject(int id) {
 	sceneObjs[nObjects].texId = rand() % numTextures;
 	sceneObjs[nObjects].texScale = 2.0;
 
+	sceneObjs[nObjects].lightType = LIGHT_NONE;
+	sceneObjs[nObjects].spread = 0.7;
+
+	clearAnimState(nObjects);
 	currObject = nObjects++;
 	setTool(&sceneObjs[currObject].loc[0], &sceneObjs[currObject].loc[2], camRotZ(),
 			&sceneObjs[currObject].scale, &sceneObjs[currObject].loc[1], mat2(0.05, 0, 0, 10.0) );
-	glutPostRedisplay();
 }
 
 // [GOZ]: PART J. Duplicate objects exactly, and set it as the current object
 static void duplicateObject(int objid) {
 	if ( nObjects >= maxObjects ) return;	// [GOZ]: Don't add an object if we don't have memory for it
 	sceneObjs[nObjects] = sceneObjs[objid];
+	clearAnimState(nObjects);
 	currObject = nObjects++;
 	setTool(&sceneObjs[currObject].loc[0], &sceneObjs[currObject].loc[2], camRotZ(),
 			&sceneObjs[currObject].scale, &sceneObjs[currObject].loc[1], mat2(0.05, 0, 0, 10.0) );
-	glutPostRedisplay();
 }
 
-// [GOZ]: PART J. Delete object and set no object currently selected. Prevent deletion of ground/lights. Set tool to camera
-static void deleteObject(int objid) {
-	if ( objid >= NUM_LG ) {
-		sceneObjs[objid] = sceneObjs[--nObjects];
-		currObject = -1;	// [GOZ]: Set no object currently selected
-		doRotate();			// [GOZ]: and go to camera mode
-		glutPostRedisplay();
+// [GOZ]: PART J. Delete object and set no object currently selected. Prevent deletion of ground/lights. Set tool to camera
+static void deleteObject(int objid) {
+	if ( objid >= NUM_LG ) {
+		sceneObjs[objid] = sceneObjs[--nObjects];
+		clearAnimState(objid);
+		currObject = -1;	// [GOZ]: Set no object currently selected
+		doRotate();			// [GOZ]: and go to camera mode
+	}
+}
+
+// [TFD]: the save/load functions
+// [GOZ]: Save files start with saveMagic and saveVersion. Files saved before any object could be a light
+// have neither, and hold a single spotlight spread for light 1 and the older SceneObject layout.
+// Version 3 adds the simulation time, which animStart is measured in. Earlier versions stored animStart
+// in milliseconds since the program started, so their animations restart when loaded.
+// Version 4 adds lightReachFraction. Earlier versions were saved before lights faded out at their reach,
+// so they load with 0, the unwindowed falloff they were lit with.
+const int saveMagic = 0x454e4353;	// "SCNE"
+const int saveVersion = 4;
+
+typedef struct {
+	vec4 loc;
+	float scale;
+	float angles[3];
+	float diffuse, specular, ambient;
+	float shine;
+	vec3 rgb;
+	float brightness;
+	int meshId;
+	int texId;
+	float texScale;
+	unsigned int animStart;
+	float FPC;
+	float moveSpeed;
+	float moveDist;
+	int numFrames;
+} SceneObjectV1;
+
+void saveSceneToFile(void){
+	FILE * pFile;
+	pFile = fopen (saveFile,"w+");
+	// [TFD]: reference: http://www.cplusplus.com/reference/cstdio/fread/
+	if (pFile == NULL) {
+		fprintf (stderr, "File error\n"); 
+	} else {
+		fwrite(&saveMagic, sizeof(int), 1, pFile);
+		fwrite(&saveVersion, sizeof(int), 1, pFile);
+		fwrite(&frameClock.simTime, sizeof(double), 1, pFile);
+		fwrite(&lightReachFraction, sizeof(float), 1, pFile);
+		fwrite(&viewDist, sizeof(float), 1, pFile);
+		fwrite(&camRotSidewaysDeg, sizeof(float), 1, pFile);
+		fwrite(&camRotUpAndOverDeg, sizeof(float), 1, pFile);
+		fwrite(&nObjects, sizeof(int), 1, pFile);
+		fwrite(sceneObjs, sizeof(SceneObject), nObjects, pFile);
+
+		fclose(pFile);
+	}
+}
+
+// [GOZ]: Reads the rest of a version 1 save file, where only objects 1 and 2 are lights.
+static void loadLegacyScene(FILE * pFile) {
+	float lightSpread;
+	SceneObjectV1 old;
+
+	fread(&viewDist, sizeof(float), 1, pFile);
+	fread(&camRotSidewaysDeg, sizeof(float), 1, pFile);
+	fread(&camRotUpAndOverDeg, sizeof(float), 1, pFile);
+	fread(&lightSpread, sizeof(float), 1, pFile);
+	fread(&nObjects, sizeof(int), 1, pFile);
+	lightReachFraction = 0.0; // See saveVersion
+
+	for(int i=0; i < nObjects; i++) {
+		fread(&old, sizeof(SceneObjectV1), 1, pFile);
+		SceneObject* so = &sceneObjs[i];
+		so->loc = old.loc; so->scale = old.scale;
+		for(int a=0; a < 3; a++) so->angles[a] = old.angles[a];
+		so->diffuse = old.diffuse; so->specular = old.specular; so->ambient = old.ambient;
+		so->shine = old.shine; so->rgb = old.rgb; so->brightness = old.brightness;
+		so->meshId = old.meshId; so->texId = old.texId; so->texScale = old.texScale;
+		so->animStart = frameClock.simTime; so->FPC = old.FPC;
+		so->moveSpeed = old.moveSpeed; so->moveDist = old.moveDist; so->numFrames = old.numFrames;
+
+		so->lightType = i == 1 ? LIGHT_SPOT : i == 2 ? LIGHT_DIRECTIONAL : LIGHT_NONE;
+		so->spread = i == 1 ? lightSpread : 0.7;
+	}
+}
+
+void loadSceneFromFile(void){
+	FILE * pFile;
+	pFile = fopen (saveFile,"r");
+
+	if (pFile!=NULL){
+		int magic = 0, version = 0;
+		fread(&magic, sizeof(int), 1, pFile);
+		if (magic != saveMagic) {
+			rewind(pFile);
+			loadLegacyScene(pFile);
+		} else {
+			fread(&version, sizeof(int), 1, pFile);
+			if (version < 2 || version > saveVersion) {
+				fprintf(stderr, "Unsupported save file version %d\n", version);
+				fclose(pFile);
+				return;
+			}
+			double savedSimTime = 0.0;
+			if (version >= 3) fread(&savedSimTime, sizeof(double), 1, pFile);
+			lightReachFraction = 0.0;
+			if (version >= 4) fread(&lightReachFraction, sizeof(float), 1, pFile);
+			fread(&viewDist, sizeof(float), 1, pFile);
+			fread(&camRotSidewaysDeg, sizeof(float), 1, pFile);
+			fread(&camRotUpAndOverDeg, sizeof(float), 1, pFile);
+			fread(&nObjects, sizeof(int), 1, pFile);
+			fread(sceneObjs, sizeof(SceneObject), nObjects, pFile);
+
+			// [GOZ]: Keep each animation's progress, or restart it for version 2 (same layout, old animStart units)
+			for(int i=0; i < nObjects; i++) {
+				if (version >= 3) sceneObjs[i].animStart += frameClock.simTime - savedSimTime;
+				else sceneObjs[i].animStart = frameClock.simTime;
+			}
+		}
+
+		for(int i=0; i < nObjects; i++) clearAnimState(i);
+		currObject = nObjects - 1;
+		doRotate();
+
+		fclose(pFile);
+	}
+}
+
+
+//------Lighting ------------------------------------------------------------
+//
+// [GOZ]: Clustered forward lighting. The view frustum is split into a grid of clusters, tiled across the
+// screen and sliced exponentially in depth. Each frame the lights are binned into the clusters they can
+// reach, and each fragment only shades the lights in its own cluster. The light data, per-cluster ranges
+// and light index lists are given to fScene.glsl as texture buffers.
+
+const int clusterX = 16, clusterY = 9, clusterZ = 24; // Clusters across, up and into the screen
+const int numClusters = clusterX * clusterY * clusterZ;
+const float lightCutoff = 1.0 / 256; // Light intensity treated as no light when deciding a light's reach
+
+vec3 clusterMin[numClusters], clusterMax[numClusters]; // View space bounds of each cluster, set in reshape
+
+typedef struct {
+	vec4 position;	// View space position (or direction for directional lights), and the type in w
+	vec4 rgbSpread;	// Colour times brightness, and the spotlight spread in w
+	vec4 direction;	// View space spotlight direction, and the light's reach in w (see gatherLights)
+} LightData;
+
+typedef struct {
+	vec3 centre;
+	float range;	// Infinite for directional lights
+} LightBounds;
+
+LightData lightData[maxObjects];
+LightBounds lightBounds[maxObjects];
+int nLights = 0;
+
+GLuint clusterRanges[numClusters][2]; // Offset and count in lightIndices for each cluster
+vector<GLuint> clusterSliceLights[clusterZ]; // Light indices for each depth slice, filled in parallel
+vector<GLuint> lightIndices;
+
+GLuint lightBuffers[3], lightTextures[3]; // Light data, cluster ranges and light indices, as texture buffers
+bool spotlightsOn; // Whether any light this frame is a spotlight with a cone narrower than a full light
+
+// The view space depths where each slice of clusters starts and ends
+static float sliceDepth(int slice) { return zNear * pow(zFar / zNear, (float)slice / clusterZ); }
+
+// Work out the view space bounding box of every cluster. Needs frustumRight and frustumTop.
+void buildClusterBounds() {
+	for(int z=0; z < clusterZ; z++) {
+		float near = sliceDepth(z), far = sliceDepth(z+1);
+		for(int y=0; y < clusterY; y++) {
+			float y0 = frustumTop / zNear * (2.0 * y / clusterY - 1.0);
+			float y1 = frustumTop / zNear * (2.0 * (y+1) / clusterY - 1.0);
+			for(int x=0; x < clusterX; x++) {
+				float x0 = frustumRight / zNear * (2.0 * x / clusterX - 1.0);
+				float x1 = frustumRight / zNear * (2.0 * (x+1) / clusterX - 1.0);
+				int c = x + clusterX * (y + clusterY * z);
+				// The frustum widens with depth, so the extremes are at one of the two depths.
+				clusterMin[c] = vec3(min(x0*near, x0*far), min(y0*near, y0*far), -far);
+				clusterMax[c] = vec3(max(x1*near, x1*far), max(y1*near, y1*far), -near);
+			}
+		}
+	}
+}
+
+// Gather every light in the scene, in view space, along with a bounding sphere of its reach.
+void gatherLights() {
+	nLights = 0;
+	spotlightsOn = false;
+	for(int i=0; i < renderScene->nObjects; i++) {
+		SceneObject so = renderScene->objs[i];
+		if(so.lightType == LIGHT_NONE) continue;
+
+		vec3 rgbBright = so.rgb * so.brightness;
+		vec4 position = so.loc;
+		if(so.lightType == LIGHT_DIRECTIONAL) position.w = 0.0;
+		position = view * position;
+		vec4 direction = view * RotateZ(so.angles[2]) * RotateY(so.angles[1]) * RotateX(so.angles[0]) * vec4( 0.0, 1.0, 0.0, 0.0);
+
+		LightData* light = &lightData[nLights];
+		light->position = vec4(position.x, position.y, position.z, so.lightType);
+		light->rgbSpread = vec4(rgbBright, so.spread);
+		light->direction = normalize(direction);
+		if(so.lightType == LIGHT_SPOT && so.spread > -1.0) spotlightsOn = true;
+
+		// The light reaches as far as its dropoff of 1 / (R/15 + 1) stays above lightReachFraction, or less
+		// for a dim light, as far as 4 * brightness / (R/15 + 1) (objects' colours are multiplied by up to
+		// 4, see display) stays above lightCutoff. The shaders fade it out towards its reach with
+		// lightWindow, so there is no edge where clusters stop shading it. With lightReachFraction 0 only
+		// lightCutoff limits the reach, and the shaders are given an infinite reach so nothing fades.
+		float fraction = renderScene->lightReachFraction;
+		float intensity = 4.0 * max(rgbBright.x, max(rgbBright.y, rgbBright.z));
+		float reach = 15.0f * (fraction > 0.0 ? min(1.0f / fraction, intensity / lightCutoff) - 1.0f
+				: intensity / lightCutoff - 1.0f);
+		LightBounds* bounds = &lightBounds[nLights];
+		bounds->centre = vec3(position.x, position.y, position.z);
+		if(so.lightType == LIGHT_DIRECTIONAL) bounds->range = INFINITY;
+		else bounds->range = min(zFar, max(1e-3f, reach));
+		light->direction.w = fraction > 0.0 ? bounds->range : INFINITY;
+
+		nLights++;
+	}
+}
+
+static bool sphereTouchesBox(vec3 centre, float range, vec3 boxMin, vec3 boxMax) {
+	if(range == INFINITY) return true;
+	float distSq = 0.0;
+	for(int a=0; a < 3; a++) {
+		float d = centre[a] < boxMin[a] ? boxMin[a] - centre[a] : centre[a] > boxMax[a] ? centre[a] - boxMax[a] : 0.0;
+		distSq += d * d;
+	}
+	return distSq <= range * range;
+}
+
+// Bin the lights into clusters, one depth slice per task on the worker pool, then join the slices into
+// lightIndices and upload everything for the fragment shader.
+void binLights() {
+	workerPool->parallelFor(clusterZ, [](int z) {
+		// Only lights reaching this slice's depth range need testing against its clusters
+		GLuint sliceLights[maxObjects];
+		int nSliceLights = 0;
+		float near = sliceDepth(z), far = sliceDepth(z+1);
+		for(int l=0; l < nLights; l++) {
+			LightBounds b = lightBounds[l];
+			if(b.range == INFINITY || (-b.centre.z + b.range >= near && -b.centre.z - b.range <= far))
+				sliceLights[nSliceLights++] = l;
+		}
+
+		vector<GLuint>& indices = clusterSliceLights[z];
+		indices.clear();
+		for(int c = z * clusterX * clusterY; c < (z+1) * clusterX * clusterY; c++) {
+			clusterRanges[c][0] = indices.size(); // Relative to the slice for now
+			for(int i=0; i < nSliceLights; i++) {
+				LightBounds b = lightBounds[sliceLights[i]];
+				if(sphereTouchesBox(b.centre, b.range, clusterMin[c], clusterMax[c]))
+					indices.push_back(sliceLights[i]);
+			}
+			clusterRanges[c][1] = indices.size() - clusterRanges[c][0];
+		}
+	});
+
+	lightIndices.clear();
+	for(int z=0; z < clusterZ; z++) {
+		GLuint sliceStart = lightIndices.size();
+		for(int c = z * clusterX * clusterY; c < (z+1) * clusterX * clusterY; c++)
+			clusterRanges[c][0] += sliceStart;
+		lightIndices.insert(lightIndices.end(), clusterSliceLights[z].begin(), clusterSliceLights[z].end());
+	}
+	if(lightIndices.empty()) lightIndices.push_back(0); // Texture buffers can't be empty
+
+	glBindBuffer(GL_TEXTURE_BUFFER, lightBuffers[0]);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(LightData) * max(nLights, 1), lightData, GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, lightBuffers[1]);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(clusterRanges), clusterRanges, GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, lightBuffers[2]);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(GLuint) * lightIndices.size(), &lightIndices[0], GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0); CheckError();
+}
+
+// Create the texture buffers for the lights.
+void initLighting() {
+	GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+	const char* names[3] = { "Light data", "Cluster lights", "Light indices" };
+	glGenBuffers(3, lightBuffers);
+	glGenTextures(3, lightTextures);
+	for(int i=0; i < 3; i++) {
+		glBindBuffer(GL_TEXTURE_BUFFER, lightBuffers[i]);
+		glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+		glBindTexture(GL_TEXTURE_BUFFER, lightTextures[i]);
+		glTexBuffer(GL_TEXTURE_BUFFER, formats[i], lightBuffers[i]); CheckError();
+		labelObject(GL_BUFFER, lightBuffers[i], "%s", names[i]);
+		labelObject(GL_TEXTURE, lightTextures[i], "%s", names[i]);
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+}
+
+// Bind the light texture buffers to units 1-3. The samplers are pointed at them in setFrameUniforms.
+void bindLighting() {
+	for(int i=0; i < 3; i++) {
+		glActiveTexture(GL_TEXTURE1 + i);
+		glBindTexture(GL_TEXTURE_BUFFER, lightTextures[i]);
+	}
+	glActiveTexture(GL_TEXTURE0);
+}
+
+
+//------Shader variants --------------------------------------------------------
+//
+// [GOZ]: Each variant is vScene.glsl and fScene.glsl compiled with the #defines for its VARIANT_ flags
+// inserted after the #version line.
+
+static char* readShaderSource(const char* fileName) {
+	FILE* fp = fopen(fileName, "rb");
+	if(fp == NULL) return NULL;
+
+	fseek(fp, 0L, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0L, SEEK_SET);
+	char* buf = new char[size + 1];
+	fread(buf, 1, size, fp);
+	buf[size] = '\0';
+	fclose(fp);
+	return buf;
+}
+
+static GLuint compileShader(GLenum type, const char* fileName, const char* source, const char* defines) {
+	const char* body = strchr(source, '\n') ? strchr(source, '\n') + 1 : source;
+	string version(source, body - source);
+	const GLchar* parts[3] = { version.c_str(), defines, body };
+
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 3, parts, NULL);
+	glCompileShader(shader);
+
+	GLint compiled;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	if(!compiled) {
+		GLint logSize;
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logSize);
+		char* logMsg = new char[logSize];
+		glGetShaderInfoLog(shader, logSize, NULL, logMsg);
+		fprintf(stderr, "%s failed to compile with:\n%s%s\n", fileName, defines, logMsg);
+		delete [] logMsg;
+		exit(EXIT_FAILURE);
+	}
+	return shader;
+}
+
+static string variantDefines(int flags) {
+	string defines;
+	if(flags & VARIANT_SKINNED) defines += "#define SKINNED\n";
+	if(flags & VARIANT_LIT) defines += "#define LIT\n";
+	if(flags & VARIANT_SPOTLIGHTS) defines += "#define SPOTLIGHTS\n";
+	if(flags & VARIANT_TEXTURED) defines += "#define TEXTURED\n";
+	if(flags & VARIANT_SKIN_ONE_BONE) defines += "#define SKIN_ONE_BONE\n";
+	if(flags & VARIANT_INDIRECT) defines += "#define INDIRECT\n";
+	if(flags & VARIANT_IMPOSTOR) defines += "#define IMPOSTOR\n";
+	if(flags & VARIANT_PICK) defines += "#define PICK\n";
+	return defines;
+}
+
+// [GOZ]: Linked programs are saved with glGetProgramBinary in shaderCacheDir, keyed by a hash of their
+// sources and #defines plus the GL vendor, renderer and version, and loaded with glProgramBinary on later
+// runs. The driver can reject a binary (e.g. after a driver update), in which case it is compiled again.
+char shaderCacheDir[256] = "shadercache"; // Set with --shader-cache=DIR, or --shader-cache= to disable
+bool shaderCacheOn = false; // Whether the driver supports program binaries, set in initShaderCache
+int shaderCacheHits = 0, shaderCacheMisses = 0, shaderCacheRejects = 0;
+string shaderCacheContext; // The GL vendor, renderer and version strings
+
+void initShaderCache() {
+	GLint numFormats = 0;
+	if(GLEW_ARB_get_program_binary) glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+	shaderCacheOn = shaderCacheDir[0] != '\0' && numFormats > 0;
+	if(!shaderCacheOn) return;
+
+	mkdir(shaderCacheDir, 0755); // Fails harmlessly if it already exists
+	shaderCacheContext = string((const char*)glGetString(GL_VENDOR)) + "\n" +
+			(const char*)glGetString(GL_RENDERER) + "\n" + (const char*)glGetString(GL_VERSION);
+}
+
+// 64 bit FNV-1a hash
+static unsigned long long hashString(const string& str, unsigned long long hash = 14695981039346656037ULL) {
+	for(size_t i=0; i < str.size(); i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static string shaderCacheFile(const char* vSource, const char* fSource, const string& defines) {
+	unsigned long long hash = hashString(shaderCacheContext);
+	hash = hashString(vSource, hash);
+	hash = hashString(fSource, hash);
+	hash = hashString(defines, hash);
+
+	char fileName[512];
+	sprintf(fileName, "%s/%016llx.bin", shaderCacheDir, hash);
+	return fileName;
+}
+
+// Load a program from the cache into program, returning false if it isn't cached or the driver rejects it.
+static bool loadCachedProgram(GLuint program, const string& fileName) {
+	FILE* fp = fopen(fileName.c_str(), "rb");
+	if(fp == NULL) return false;
+
+	GLenum format;
+	fseek(fp, 0L, SEEK_END);
+	long size = ftell(fp) - sizeof(GLenum);
+	fseek(fp, 0L, SEEK_SET);
+	if(size <= 0 || fread(&format, sizeof(GLenum), 1, fp) != 1) { fclose(fp); return false; }
+	vector<char> binary(size);
+	size_t nRead = fread(&binary[0], 1, size, fp);
+	fclose(fp);
+	if(nRead != (size_t)size) return false;
+
+	glProgramBinary(program, format, &binary[0], size);
+	GLint linked;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if(!linked) shaderCacheRejects++;
+	return linked;
+}
+
+static void saveCachedProgram(GLuint program, const string& fileName) {
+	GLint size = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+	if(size <= 0) return;
+
+	GLenum format;
+	vector<char> binary(size);
+	glGetProgramBinary(program, size, NULL, &format, &binary[0]);
+
+	FILE* fp = fopen(fileName.c_str(), "wb");
+	if(fp == NULL) return;
+	fwrite(&format, sizeof(GLenum), 1, fp);
+	fwrite(&binary[0], 1, size, fp);
+	fclose(fp);
+}
+
+// Compile and link a vertex and fragment shader with the given #defines, or load the linked program
+// from the cache. Exits on errors, like InitShader.
+GLuint buildProgram(const char* vName, const char* vSource, const char* fName, const char* fSource,
+		const string& defines) {
+	GLuint program = glCreateProgram();
+	string cacheFile;
+	if(shaderCacheOn) {
+		cacheFile = shaderCacheFile(vSource, fSource, defines);
+		if(loadCachedProgram(program, cacheFile)) {
+			shaderCacheHits++;
+			return program;
+		}
+		shaderCacheMisses++;
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+
+	GLuint vShader = compileShader(GL_VERTEX_SHADER, vName, vSource, defines.c_str());
+	GLuint fShader = compileShader(GL_FRAGMENT_SHADER, fName, fSource, defines.c_str());
+	glAttachShader(program, vShader);
+	glAttachShader(program, fShader);
+
+	glBindAttribLocation(program, vPosition, "vPosition");
+	glBindAttribLocation(program, vNormal, "vNormal");
+	glBindAttribLocation(program, vTexCoord, "vTexCoord");
+	glBindAttribLocation(program, vBoneIDs, "boneIDs");
+	glBindAttribLocation(program, vBoneWeights, "boneWeights");
+	glBindAttribLocation(program, vObjectIndex, "vObjectIndex");
+	glBindFragDataLocation(program, 0, "fColor");
+	glBindFragDataLocation(program, 0, "fPickId"); // Instead of fColor in PICK variants
+	glBindFragDataLocation(program, 1, "fNormalDepth"); // Only in fBake.glsl
+	glLinkProgram(program);
+
+	GLint linked;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if(!linked) {
+		GLint logSize;
+		glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logSize);
+		char* logMsg = new char[logSize];
+		glGetProgramInfoLog(program, logSize, NULL, logMsg);
+		fprintf(stderr, "Shader program failed to link with:\n%s%s\n", defines.c_str(), logMsg);
+		delete [] logMsg;
+		exit(EXIT_FAILURE);
+	}
+	glDetachShader(program, vShader);
+	glDetachShader(program, fShader);
+	glDeleteShader(vShader);
+	glDeleteShader(fShader);
+
+	if(shaderCacheOn) saveCachedProgram(program, cacheFile);
+	return program;
+}
+
+static void buildVariant(int flags, const char* vSource, const char* fSource) {
+	GLuint program = buildProgram("vScene.glsl", vSource, "fScene.glsl", fSource, variantDefines(flags));
+
+	ShaderVariant* v = &shaderVariants[flags];
+	v->program = program;
+	v->projectionU = glGetUniformLocation(program, "Projection");
+	v->modelViewU = glGetUniformLocation(program, "ModelView");
+	v->boneTransformsU = glGetUniformLocation(program, "boneTransforms");
+	v->texArrayU = glGetUniformLocation(program, "texArray");
+	v->texLayerU = glGetUniformLocation(program, "texLayer");
+	v->texScaleU = glGetUniformLocation(program, "texScale");
+	v->texColorU = glGetUniformLocation(program, "texColor");
+	v->ambientProductU = glGetUniformLocation(program, "AmbientProduct");
+	v->diffuseProductU = glGetUniformLocation(program, "DiffuseProduct");
+	v->specularProductU = glGetUniformLocation(program, "SpecularProduct");
+	v->shininessU = glGetUniformLocation(program, "Shininess");
+	v->lightDataU = glGetUniformLocation(program, "lightData");
+	v->clusterLightsU = glGetUniformLocation(program, "clusterLights");
+	v->lightIndicesU = glGetUniformLocation(program, "lightIndices");
+	v->clusterDimsU = glGetUniformLocation(program, "clusterDims");
+	v->viewportSizeU = glGetUniformLocation(program, "viewportSize");
+	v->clusterScaleU = glGetUniformLocation(program, "clusterScale");
+	v->clusterBiasU = glGetUniformLocation(program, "clusterBias");
+	v->viewU = glGetUniformLocation(program, "View");
+	v->objectDataU = glGetUniformLocation(program, "objectData");
+	v->layerMinLevelsU = glGetUniformLocation(program, "layerMinLevels");
+	v->fadeU = glGetUniformLocation(program, "Fade");
+	v->impostorTexCoordsU = glGetUniformLocation(program, "impostorTexCoords");
+	v->impostorNormalsU = glGetUniformLocation(program, "impostorNormals");
+	v->impostorLayerU = glGetUniformLocation(program, "impostorLayer");
+	v->impostorRadiusU = glGetUniformLocation(program, "impostorRadius");
+	v->pickIdU = glGetUniformLocation(program, "pickId");
+	v->frameUniformsSet = -1;
+	CheckError();
+
+	string name = "Scene shader";
+	const char* flagNames[] = { "SKINNED", "LIT", "SPOTLIGHTS", "TEXTURED", "SKIN_ONE_BONE", "INDIRECT", "IMPOSTOR",
+			"PICK" };
+	for(int f=0; (1 << f) < numVariants; f++)
+		if(flags & (1 << f)) name = name + " " + flagNames[f];
+	labelObject(GL_PROGRAM, program, "%s", name.c_str());
+}
+
+// Build every variant. There are few enough that compiling them all up front avoids stalls later.
+void buildVariants() {
+	char* vSource = readShaderSource("vScene.glsl");
+	char* fSource = readShaderSource("fScene.glsl");
+	if(vSource == NULL) { fprintf(stderr, "Failed to read vScene.glsl\n"); exit(EXIT_FAILURE); }
+	if(fSource == NULL) { fprintf(stderr, "Failed to read fScene.glsl\n"); exit(EXIT_FAILURE); }
+
+	for(int flags=0; flags < numVariants; flags++) {
+		if((flags & VARIANT_SPOTLIGHTS) && !(flags & VARIANT_LIT)) continue; // Never used, see variantFor
+		if((flags & VARIANT_SKIN_ONE_BONE) && !(flags & VARIANT_SKINNED)) continue;
+		if((flags & VARIANT_INDIRECT) && (!gpuDriven ||
+				(flags & (VARIANT_SKINNED | VARIANT_TEXTURED | VARIANT_SKIN_ONE_BONE)))) continue;
+		if((flags & VARIANT_IMPOSTOR) && (impostorSize <= 0 ||
+				(flags & (VARIANT_SKINNED | VARIANT_SKIN_ONE_BONE | VARIANT_INDIRECT)))) continue;
+		if((flags & VARIANT_PICK) && (!(flags & (VARIANT_INDIRECT | VARIANT_IMPOSTOR)) ||
+				(flags & (VARIANT_LIT | VARIANT_SPOTLIGHTS | VARIANT_TEXTURED)))) continue;
+		buildVariant(flags, vSource, fSource);
+	}
+
+	delete [] vSource;
+	delete [] fSource;
+
+	if(shaderCacheOn)
+		printf("Shader cache: %d hits, %d misses, %d rejected binaries\n",
+				shaderCacheHits, shaderCacheMisses, shaderCacheRejects);
+}
+
+// Uniforms that are the same for every object in a frame
+static void setFrameUniforms(ShaderVariant* v) {
+	glUniformMatrix4fv( v->projectionU, 1, GL_TRUE, projection );
+	glUniform1i( v->texArrayU, 0 );
+
+	glUniform1i(v->lightDataU, 1);
+	glUniform1i(v->clusterLightsU, 2);
+	glUniform1i(v->lightIndicesU, 3);
+	glUniform1i(v->objectDataU, 4);
+	glUniform1i(v->layerMinLevelsU, 5);
+	glUniform1i(v->impostorTexCoordsU, 6);
+	glUniform1i(v->impostorNormalsU, 7);
+
+	// slice = log(depth / zNear) * clusterZ / log(zFar / zNear) = log(depth) * scale + bias
+	float scale = clusterZ / log(zFar / zNear);
+	glUniform3i(v->clusterDimsU, clusterX, clusterY, clusterZ);
+	glUniform2f(v->viewportSizeU, renderWidth, renderHeight);
+	glUniform1f(v->clusterScaleU, scale);
+	glUniform1f(v->clusterBiasU, -log(zNear) * scale); CheckError();
+
+	v->frameUniformsSet = resourceFrame;
+}
+
+// Switch to a variant's program, if it isn't already in use, setting its per-frame uniforms the first
+// time it is used in a frame.
+ShaderVariant* useVariant(int flags) {
+	ShaderVariant* v = &shaderVariants[flags];
+	if(currVariant != flags) {
+		glUseProgram(v->program); CheckError();
+		currVariant = flags;
+	}
+	if(v->frameUniformsSet != resourceFrame) setFrameUniforms(v);
+	return v;
+}
+
+// The cheapest variant that can draw an object, given this frame's lights. Loads the object's mesh and
+// reads its texture if needed to decide.
+int variantFor(const SceneObject* so) {
+	int flags = 0;
+	if(nLights > 0) flags |= VARIANT_LIT;
+	if(nLights > 0 && spotlightsOn) flags |= VARIANT_SPOTLIGHTS;
+
+	loadMeshIfNotAlreadyLoaded(so->meshId);
+	if(meshes[so->meshId]->numBones > 0) flags |= VARIANT_SKINNED;
+	if(!isPlainTexture(so->texId)) flags |= VARIANT_TEXTURED;
+	return flags;
+}
+
+
+//------Dynamic resolution ------------------------------------------------------
+//
+// [GOZ]: With --dynamic-res, the scene is drawn into an offscreen framebuffer at resScale times the
+// window size, then stretched to the window with a linear blit. resScale follows the GPU time of each
+// frame (from timer queries, or the time between frames without ARB_timer_query), moving towards the
+// scale that would take targetFrameMs, within resScaleMin and resScaleMax.
+
+bool dynamicRes = false;
+float targetFrameMs = 16.7;
+float resScaleMin = 0.5, resScaleMax = 1.0;
+float resScale = 1.0;
+float gpuFrameMs = 0.0; // Smoothed frame time the scale is adjusted from
+
+GLuint sceneFBO, sceneColour, sceneDepthStencil; // Sized for resScaleMax, only partly used below that
+GLint sceneFBOWidth, sceneFBOHeight;
+
+const int numFrameQueries = 4; // Enough that results are read a few frames late, without waiting
+GLuint frameQueries[numFrameQueries];
+int frameQueryCount = 0; // Queries issued so far
+bool useTimerQueries;
+chrono::steady_clock::time_point lastFrameEnd;
+
+void initDynamicRes() {
+	if(!dynamicRes) return;
+	resScaleMin = max(0.1f, min(resScaleMin, 1.0f));
+	resScaleMax = max(resScaleMin, min(resScaleMax, 2.0f));
+	resScale = resScaleMax;
+
+	glGenFramebuffers(1, &sceneFBO);
+	glGenTextures(1, &sceneColour);
+	glGenRenderbuffers(1, &sceneDepthStencil); CheckError();
+	sceneFBOWidth = sceneFBOHeight = 0;
+
+	useTimerQueries = GLEW_ARB_timer_query || GLEW_VERSION_3_3;
+	if(useTimerQueries) glGenQueries(numFrameQueries, frameQueries);
+	else printf("No ARB_timer_query, dynamic resolution will use the time between frames\n");
+	lastFrameEnd = chrono::steady_clock::now();
+}
+
+// (Re)allocate the offscreen framebuffer for the window size. Called from reshape.
+void resizeSceneFBO() {
+	if(!dynamicRes) return;
+	sceneFBOWidth = (int)ceil(windowWidth * resScaleMax);
+	sceneFBOHeight = (int)ceil(windowHeight * resScaleMax);
+
+	glBindTexture(GL_TEXTURE_2D, sceneColour);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, sceneFBOWidth, sceneFBOHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glBindRenderbuffer(GL_RENDERBUFFER, sceneDepthStencil);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, sceneFBOWidth, sceneFBOHeight); CheckError();
+
+	glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sceneColour, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, sceneDepthStencil);
+	labelObject(GL_FRAMEBUFFER, sceneFBO, "Dynamic resolution scene");
+	labelObject(GL_TEXTURE, sceneColour, "Dynamic resolution colour");
+	labelObject(GL_RENDERBUFFER, sceneDepthStencil, "Dynamic resolution depth and stencil");
+	if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		printf("Error - incomplete dynamic resolution framebuffer\n");
+		exit(1);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0); CheckError();
+}
+
+// Move resScale towards the target from the latest frame time. Pixels drawn go with the square of
+// the scale, so the step is half the (damped) log of the time ratio.
+static void adjustResScale(float frameMs) {
+	gpuFrameMs = gpuFrameMs == 0.0 ? frameMs : 0.9 * gpuFrameMs + 0.1 * frameMs;
+	float ratio = targetFrameMs / gpuFrameMs;
+	if(ratio > 0.95 && ratio < 1.1) return; // Close enough, don't hunt
+	resScale = max(resScaleMin, min(resScaleMax, resScale * powf(ratio, 0.5 * 0.1)));
+}
+
+// Start drawing a frame: set the render size and bind the framebuffer to draw into
+void beginSceneFrame() {
+	if(!dynamicRes) {
+		renderWidth = windowWidth;
+		renderHeight = windowHeight;
+		return;
+	}
+
+	// Read the oldest query once its result is in, then reuse it for this frame
+	if(useTimerQueries) {
+		GLuint query = frameQueries[frameQueryCount % numFrameQueries];
+		if(frameQueryCount >= numFrameQueries) {
+			GLint available = 0;
+			glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if(available) {
+				GLuint64 ns;
+				glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+				adjustResScale(ns / 1e6);
+			}
+		}
+		glBeginQuery(GL_TIME_ELAPSED, query); CheckError();
 	}
+
+	renderWidth = max(1, (int)(windowWidth * resScale));
+	renderHeight = max(1, (int)(windowHeight * resScale));
+	glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+	glViewport(0, 0, renderWidth, renderHeight); CheckError();
 }
 
-// [TFD]: the save/load functions
-void saveSceneToFile(void){
-	FILE * pFile;
-	pFile = fopen (saveFile,"w+");
-	// [TFD]: reference: http://www.cplusplus.com/reference/cstdio/fread/
-	if (pFile == NULL) {
-		fprintf (stderr, "File error\n"); 
+// Finish a frame: stretch the scene to the window
+void endSceneFrame() {
+	if(!dynamicRes) return;
+
+	pushDebugGroup("Dynamic resolution upscale");
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFBO);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glBlitFramebuffer(0, 0, renderWidth, renderHeight, 0, 0, windowWidth, windowHeight,
+			GL_COLOR_BUFFER_BIT, GL_LINEAR);
+	popDebugGroup();
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, windowWidth, windowHeight); CheckError();
+
+	if(useTimerQueries) {
+		glEndQuery(GL_TIME_ELAPSED); CheckError();
+		frameQueryCount++;
 	} else {
-		fwrite(&viewDist, sizeof(float), 1, pFile);
-		fwrite(&camRotSidewaysDeg, sizeof(float), 1, pFile);
-		fwrite(&camRotUpAndOverDeg, sizeof(float), 1, pFile);
-		fwrite(&lightSpread, sizeof(float), 1, pFile);
-		fwrite(&nObjects, sizeof(int), 1, pFile);
-		fwrite(sceneObjs, sizeof(SceneObject), nObjects, pFile);
-
-		fclose(pFile);
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		adjustResScale(chrono::duration<float, milli>(now - lastFrameEnd).count());
+		lastFrameEnd = now;
 	}
 }
 
-void loadSceneFromFile(void){
-	FILE * pFile;
-	pFile = fopen (saveFile,"r");
-
-	if (pFile!=NULL){
-		fread(&viewDist, sizeof(float), 1, pFile);
-		fread(&camRotSidewaysDeg, sizeof(float), 1, pFile);
-		fread(&camRotUpAndOverDeg, sizeof(float), 1, pFile);
-		fread(&lightSpread, sizeof(float), 1, pFile);
-		fread(&nObjects, sizeof(int), 1, pFile);
-		fread(sceneObjs, sizeof(SceneObject), nObjects, pFile);
+// The render target pixel under window pixel (x, y), with y measured up from the bottom
+static void windowToRender(int x, int y, GLint* rx, GLint* ry) {
+	*rx = (GLint)((x + 0.5) * renderWidth / windowWidth);
+	*ry = (GLint)((y + 0.5) * renderHeight / windowHeight);
+}
 
-		currObject = nObjects - 1;
-		doRotate();
 
-		fclose(pFile);
+//------GPU-driven drawing -------------------------------------------------------
+//
+// [GOZ]: Meshes without bones live in one shared vertex buffer and one shared index buffer (see
+// loadSharedMesh). Each frame the transform, material and bounding sphere of every object using them is
+// written to objectBuffer, a compute shader (cCull.glsl) frustum culls the objects and fills in one draw
+// command per mesh, and they are all drawn with one glMultiDrawElementsIndirect. Without the extensions
+// (or with --no-gpu-driven), every object goes through the per-object path in display instead.
+// Skinned objects always use the per-object path, as they need their own bone transforms.
+
+const int objectTexels = 10; // vec4s per object in objectBuffer, see vScene.glsl and cCull.glsl
+
+typedef struct { // As read by glMultiDrawElementsIndirect
+	GLuint count, instanceCount, firstIndex;
+	GLint baseVertex;
+	GLuint baseInstance;
+} DrawElementsIndirectCommand;
+
+GLuint objectBuffer, objectTexture; // The object texels, also read by the vertex shader as a texture buffer
+GLuint commandBuffer, meshCommandBuffer, visibleBuffer; // Draw commands, each mesh's command, visible objects
+GLuint indirectVAO; // The shared buffers, plus the visible object index for each instance
+GLuint cullProgram;
+GLint cullNumObjectsU, cullFrustumPlanesU;
+
+void initGPUDriven() {
+	gpuDriven = gpuDrivenAllowed && GLEW_ARB_multi_draw_indirect && GLEW_ARB_compute_shader &&
+			GLEW_ARB_shader_storage_buffer_object && GLEW_ARB_base_instance;
+	if(!gpuDriven) {
+		if(gpuDrivenAllowed) printf("No multi-draw-indirect or compute shaders, drawing each object separately\n");
+		return;
 	}
-}
 
+	sharedVertices.free.push_back(make_pair(0, sharedVertexCapacity));
+	sharedIndices.free.push_back(make_pair(0, sharedIndexCapacity));
+	glGenBuffers(1, &sharedVertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, sharedVertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(float)*sharedVertexFloats*sharedVertexCapacity, NULL, GL_STATIC_DRAW);
+	glGenBuffers(1, &sharedIndexBuffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, sharedIndexBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, sizeof(GLuint)*sharedIndexCapacity, NULL, GL_STATIC_DRAW); CheckError();
+
+	glGenBuffers(1, &objectBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, objectBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(vec4) * objectTexels * maxObjects, NULL, GL_STREAM_DRAW);
+	glGenTextures(1, &objectTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, objectTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, objectBuffer);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0); CheckError();
+
+	glGenBuffers(1, &commandBuffer);
+	glGenBuffers(1, &meshCommandBuffer);
+	glGenBuffers(1, &visibleBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, visibleBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(GLint) * maxObjects, NULL, GL_STREAM_DRAW); CheckError();
+
+	glGenVertexArrays(1, &indirectVAO);
+	glBindVertexArray(indirectVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, sharedVertexBuffer);
+	GLsizei stride = sizeof(float) * sharedVertexFloats;
+	glVertexAttribPointer(vPosition, 3, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET(0));
+	glVertexAttribPointer(vTexCoord, 2, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET(sizeof(float)*3));
+	glVertexAttribPointer(vNormal, 3, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET(sizeof(float)*5));
+	glEnableVertexAttribArray(vPosition);
+	glEnableVertexAttribArray(vTexCoord);
+	glEnableVertexAttribArray(vNormal);
+	glBindBuffer(GL_ARRAY_BUFFER, visibleBuffer);
+	glVertexAttribIPointer(vObjectIndex, 1, GL_INT, 0, BUFFER_OFFSET(0));
+	glVertexAttribDivisor(vObjectIndex, 1);
+	glEnableVertexAttribArray(vObjectIndex);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sharedIndexBuffer);
+	glBindVertexArray(0); CheckError();
+
+	char* cSource = readShaderSource("cCull.glsl");
+	if(cSource == NULL) { fprintf(stderr, "Failed to read cCull.glsl\n"); exit(EXIT_FAILURE); }
+	GLuint cShader = compileShader(GL_COMPUTE_SHADER, "cCull.glsl", cSource, "");
+	delete [] cSource;
+	cullProgram = glCreateProgram();
+	glAttachShader(cullProgram, cShader);
+	glLinkProgram(cullProgram);
+	GLint linked;
+	glGetProgramiv(cullProgram, GL_LINK_STATUS, &linked);
+	if(!linked) { fprintf(stderr, "cCull.glsl failed to link\n"); exit(EXIT_FAILURE); }
+	glDetachShader(cullProgram, cShader);
+	glDeleteShader(cShader);
+	cullNumObjectsU = glGetUniformLocation(cullProgram, "numObjects");
+	cullFrustumPlanesU = glGetUniformLocation(cullProgram, "frustumPlanes"); CheckError();
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer); // Bound once so that they exist to be labelled
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, meshCommandBuffer);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	labelObject(GL_BUFFER, sharedVertexBuffer, "Shared vertices");
+	labelObject(GL_BUFFER, sharedIndexBuffer, "Shared indices");
+	labelObject(GL_BUFFER, objectBuffer, "Object data");
+	labelObject(GL_TEXTURE, objectTexture, "Object data");
+	labelObject(GL_BUFFER, commandBuffer, "Draw commands");
+	labelObject(GL_BUFFER, meshCommandBuffer, "Mesh draw commands");
+	labelObject(GL_BUFFER, visibleBuffer, "Visible objects");
+	labelObject(GL_VERTEX_ARRAY, indirectVAO, "Shared meshes");
+	labelObject(GL_PROGRAM, cullProgram, "Frustum culling");
+}
 
-// ------ The init function
+// [GOZ]: PART B. Scale, then Rotate about X, then Y, then Z, then translate.
+mat4 modelMatrix(const SceneObject& so) {
+	return Translate(so.loc) * RotateZ(so.angles[2]) * RotateY(so.angles[1]) * RotateX(so.angles[0]) * Scale(so.scale);
+}
 
-void init( void )
-{
-	srand ( time(NULL) ); /* initialize random seed - so the starting scene varies */
-	aiInit();
+vector<DrawElementsIndirectCommand> gpuCommands; // This frame's commands, before culling fills them in
+
+// Fill in commandBuffer and visibleBuffer with the objects in objectBuffer (the first n) that are in the
+// frustum of projection. Called again with a narrower projection when picking, see pickObject.
+static void cullGPUDriven(const mat4& proj, int n) {
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawElementsIndirectCommand) * gpuCommands.size(),
+			&gpuCommands[0], GL_STREAM_DRAW);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+	// Frustum planes from the rows of projection * view (Gribb and Hartmann), normalised so the culling
+	// shader can compare distances with radii
+	mat4 pv = proj * view;
+	vec4 planes[6];
+	for(int p=0; p < 6; p++) {
+		int row = p / 2;
+		float sign = p % 2 == 0 ? 1.0 : -1.0;
+		planes[p] = pv[3] + sign * pv[row];
+		float len = sqrt(planes[p].x*planes[p].x + planes[p].y*planes[p].y + planes[p].z*planes[p].z);
+		planes[p] = planes[p] * (1.0f / len);
+	}
 
-	//    for(int i=0; i<numMeshes; i++)
-	//        meshes[i] = NULL;
+	pushDebugGroup("GPU-driven culling");
+	glUseProgram(cullProgram);
+	currVariant = -1;
+	glUniform1i(cullNumObjectsU, n);
+	glUniform4fv(cullFrustumPlanesU, 6, (const GLfloat*)planes);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, objectBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, commandBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, meshCommandBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, visibleBuffer);
+	glDispatchCompute((n + 63) / 64, 1, 1);
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT); CheckError();
+	popDebugGroup();
+}
 
-	glGenVertexArrays(numMeshes, vaoIDs); CheckError(); // Allocate vertex array objects for meshes
-	glGenTextures(numTextures, textureIDs); CheckError(); // Allocate texture objects
+// Draw the objects cullGPUDriven left visible, with stencil 0 (see display)
+static void drawCulledGPUDriven(int flags) {
+	ShaderVariant* v = useVariant(flags);
+	glUniformMatrix4fv(v->viewU, 1, GL_TRUE, view);
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_BUFFER, objectTexture);
+	glActiveTexture(GL_TEXTURE0);
+
+	glStencilFunc(GL_ALWAYS, 0, -1);
+	glBindVertexArray(indirectVAO);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+	glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, NULL, gpuCommands.size(), 0); CheckError();
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
 
-	// Load shaders and use the resulting shader program
-	shaderProgram = InitShader( "vScene.glsl", "fScene.glsl" );
+// Cull and draw the n objects in objs (indices into sc->objs), whose meshes are in the shared buffers.
+// They are drawn with stencil 0, see display. fades (indexed like sc->objs) is for impostors, see Impostors.
+void drawGPUDriven(const SceneSnapshot* sc, const int* objs, int n, int lightFlags, const float* fades) {
+	if(n == 0) return;
+
+	// The object texels, and how many objects use each mesh
+	static vec4 objectData[objectTexels * maxObjects];
+	int meshCount[numMeshes] = { 0 };
+	for(int k=0; k < n; k++) {
+		const SceneObject& so = sc->objs[objs[k]];
+		vec4* t = &objectData[objectTexels * k];
+		mat4 model = modelMatrix(so);
+		for(int c=0; c < 4; c++) t[c] = vec4(model[0][c], model[1][c], model[2][c], model[3][c]);
+
+		vec3 rgb = so.rgb * so.brightness * 4.0; // As in drawMesh
+		bool plain = texPlain[so.texId] == 1;
+		int layer = plain ? -1 : loadTextureIfNotAlreadyLoaded(so.texId);
+		vec3 colour = plain ? texPlainColor[so.texId] : vec3(0.0, 0.0, 0.0);
+		t[4] = vec4(so.ambient * rgb, so.shine);
+		t[5] = vec4(so.diffuse * rgb, so.texScale);
+		t[6] = vec4(so.specular * rgb, layer);
+		t[7] = vec4(colour, so.meshId);
+		t[8] = vec4(so.loc.x, so.loc.y, so.loc.z, meshRadius[so.meshId] * so.scale);
+		t[9] = vec4(fades[objs[k]], 0.0, 0.0, 0.0);
+		meshCount[so.meshId]++;
+	}
 
-	glUseProgram( shaderProgram ); CheckError();
+	// One command per mesh in use, with a run of visibleBuffer for its instances. The instance counts
+	// start at 0 and are counted up by the culling shader.
+	gpuCommands.clear();
+	GLint meshCommands[numMeshes];
+	GLuint nextInstance = 0;
+	for(int m=0; m < numMeshes; m++) {
+		meshCommands[m] = -1;
+		if(meshCount[m] == 0) continue;
+		DrawElementsIndirectCommand cmd = { (GLuint)meshes[m]->numFaces * 3, 0, (GLuint)meshes[m]->firstIndex,
+				meshes[m]->baseVertex, nextInstance };
+		meshCommands[m] = gpuCommands.size();
+		gpuCommands.push_back(cmd);
+		nextInstance += meshCount[m];
+	}
 
-	// Initialize the vertex position attribute from the vertex shader    
-	vPosition = glGetAttribLocation( shaderProgram, "vPosition" );
-	vNormal = glGetAttribLocation( shaderProgram, "vNormal" ); CheckError();
-	vBoneIDs = glGetAttribLocation(shaderProgram, "boneIDs"); CheckError();		// [TFD]: Part D.B3
-	vBoneWeights = glGetAttribLocation(shaderProgram, "boneWeights"); CheckError();
+	glBindBuffer(GL_TEXTURE_BUFFER, objectBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(vec4) * objectTexels * maxObjects, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(vec4) * objectTexels * n, objectData);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, meshCommandBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(meshCommands), meshCommands, GL_STREAM_DRAW); CheckError();
+
+	cullGPUDriven(projection, n);
+	pushDebugGroup("GPU-driven drawing");
+	drawCulledGPUDriven(VARIANT_INDIRECT | lightFlags);
+	popDebugGroup();
+}
 
-	// Likewise, initialize the vertex texture coordinates attribute.  
-	vTexCoord = glGetAttribLocation( shaderProgram, "vTexCoord" ); CheckError();
+// ------ The init function
 
-	projectionU = glGetUniformLocation(shaderProgram, "Projection");
-	modelViewU = glGetUniformLocation(shaderProgram, "ModelView");
+void initImpostors(); // See Impostors, after drawMesh
+void initPicking(); // See pickObject, after drawImpostors
 
-	// [TFD]: Part D.B3
-	boneTransformsU = glGetUniformLocation(shaderProgram, "boneTransforms");
-	
+// [GOZ]: The starting scene. Also used by the software renderer, see renderSoftware.
+void initScene() {
 	// Objects 0, and 1 are the ground and the first light.
 	addObject(0); // Square for the ground
 	sceneObjs[0].loc = vec4(0.0, 0.0, 0.0, 1.0);
@@ -436,6 +2310,8 @@ void init( void )
 	sceneObjs[1].scale = 0.1;
 	sceneObjs[1].texId = 0; // Plain texture
 	sceneObjs[1].brightness = 0.2; // The light's brightness is 5 times this (below).
+	sceneObjs[1].lightType = LIGHT_SPOT;
+	sceneObjs[1].spread = -1.0; // Starts as a full light
 
 	// [GOZ]: PART I. Added second light
 	addObject(55); // Sphere for the second light
@@ -443,8 +2319,36 @@ void init( void )
 	sceneObjs[currObject].scale = 0.2;
 	sceneObjs[currObject].texId = 0; // Plain texture
 	sceneObjs[currObject].brightness = 0.2; // The light's brightness is 5 times this (below).
+	sceneObjs[currObject].lightType = LIGHT_DIRECTIONAL;
 
 	addObject(rand() % numMeshes); // A test mesh
+}
+
+void init( void )
+{
+	srand ( randomSeed ); /* initialize random seed - so the starting scene varies */
+	initDebugOutput(glDebugSync);	// [GOZ]: First, so the rest of init is reported
+	aiInit();
+
+	//    for(int i=0; i<numMeshes; i++)
+	//        meshes[i] = NULL;
+
+	glGenVertexArrays(numMeshes, vaoIDs); CheckError(); // Allocate vertex array objects for meshes
+	initTextureArray(); // Allocate the texture array
+
+	// Load shaders and build the shader programs
+	// [GOZ]: One program for each variant, see buildVariants
+	initShaderCache();
+	initGPUDriven(); // [GOZ]: Before the variants, as the INDIRECT ones are only built if it's supported
+	buildVariants();
+	initImpostors();
+	initPicking();
+
+	startWorkerPool();
+	initLighting();
+	initDynamicRes();
+	initScene();
+	prefetchTextures();	// [GOZ]: In the background, see loadTextureData
 
 	// We need to enable the depth test to discard fragments that
 	// are behind previously drawn fragments for the same pixel.
@@ -458,59 +2362,619 @@ void init( void )
 	glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
 }
 
-//----------------------------------------------------------------------------
+//------Simulation --------------------------------------------------------------
+//
+// [GOZ]: Animated objects (meshId > 55) move on frameClock's fixed timestep. Each step records their
+// animation time and displacement, and frames are drawn between the last two steps, so the motion is
+// the same whatever the frame rate.
+
+// [TFD]: An object's animation time and displacement at a simulation time
+static void animateObject(SceneObject* so, double simTime, float* elapsedTime, vec4* displacement) {
+	if (so->FPC < 0.0) so->FPC = 0.0;	// [TFD]: Avoid -ve FPC
+	if (so->moveDist <= 0.0) so->moveDist = 0.1;	// [TFD]: Avoid dividing by 0
+	if (so->moveSpeed <= 0.0) so->moveSpeed = 0.1;
+
+	// [TFD]: Time since animation began in seconds
+	*elapsedTime = float ( simTime - so->animStart );
+	float period = so->moveDist / so->moveSpeed;		// [TFD]: The time taken to complete one movement cycle
+
+	// [TFD]: displacement ranges from 0.5 moveDist to -0.5 moveDist in the direction the object is facing
+	*displacement = RotateZ(so->angles[2]) * RotateY(so->angles[1]) * RotateX(so->angles[0]) *
+				vec4( 0.0, 0.0, - 0.5 * so->moveDist * sin(*elapsedTime / period * 2 * PI), 0.0);
+}
+
+// Advance every animated object by one step, to frameClock.simTime
+void stepSimulation() {
+	for(int i=0; i < nObjects; i++) {
+		if (sceneObjs[i].meshId <= 55) continue;
+		AnimState* s = &animStates[i];
+		s->elapsedTime[0] = s->elapsedTime[1];
+		s->displacement[0] = s->displacement[1];
+		animateObject(&sceneObjs[i], frameClock.simTime, &s->elapsedTime[1], &s->displacement[1]);
+		if (!s->valid) {
+			s->elapsedTime[0] = s->elapsedTime[1];
+			s->displacement[0] = s->displacement[1];
+			s->valid = true;
+		}
+	}
+}
 
-void drawMesh(SceneObject sceneObj) {
+// An animated object's animation time and displacement for this frame, between its last two steps
+void interpolatedAnimation(int i, float* elapsedTime, vec4* displacement) {
+	AnimState* s = &animStates[i];
+	if (!s->valid) { // Added since the last step
+		animateObject(&sceneObjs[i], frameClock.simTime, &s->elapsedTime[1], &s->displacement[1]);
+		s->elapsedTime[0] = s->elapsedTime[1];
+		s->displacement[0] = s->displacement[1];
+		s->valid = true;
+	}
+	float a = frameClock.alpha();
+	*elapsedTime = s->elapsedTime[0] + a * (s->elapsedTime[1] - s->elapsedTime[0]);
+	*displacement = s->displacement[0] + a * (s->displacement[1] - s->displacement[0]);
+}
 
-	// Activate a texture, loading if needed.
-	loadTextureIfNotAlreadyLoaded(sceneObj.texId);
-	glActiveTexture(GL_TEXTURE0 );
-	glBindTexture(GL_TEXTURE_2D, textureIDs[sceneObj.texId]);
+// Fill in a snapshot of the scene for the render thread
+static void takeSnapshot(SceneSnapshot* snap) {
+	snap->nObjects = nObjects;
+	snap->viewDist = viewDist;
+	snap->camRotSidewaysDeg = camRotSidewaysDeg;
+	snap->camRotUpAndOverDeg = camRotUpAndOverDeg;
+	snap->lightReachFraction = lightReachFraction;
+	snap->mouseX = mouseX;
+	snap->mouseY = mouseY;
+
+	for(int i=0; i < nObjects; i++) {
+		if ( sceneObjs[i].spread > 1.0 ) sceneObjs[i].spread = 1.0;	// [TFD]: Cap spotlight spread
+		else if ( sceneObjs[i].spread < -1.0 ) sceneObjs[i].spread = -1.0;
+
+		snap->objs[i] = sceneObjs[i];
+		snap->serials[i] = objectSerials[i];
+		snap->elapsedTime[i] = 0.0;
+		if (sceneObjs[i].meshId > 55) {
+			vec4 displacement;
+			interpolatedAnimation(i, &snap->elapsedTime[i], &displacement);
+			snap->objs[i].loc += displacement;
+		}
+	}
+}
 
-	// Texture 0 is the only texture type in this program, and is for the rgb colour of the
-	// surface but there could be separate types for, e.g., specularity and normals. 
-	glUniform1i( glGetUniformLocation(shaderProgram, "texture"), 0 );
+// The simulation thread. Each time display() takes a snapshot, run the commands posted since the last
+// frame, advance the simulation and fill in the snapshot display() isn't drawing.
+static void simulationLoop() {
+	for(;;) {
+		deque<function<void()> > commands;
+		int frame;
+		double inputTime;
+		{
+			unique_lock<mutex> waitLock(simLock);
+			simWake.wait(waitLock, []() { return frameRequested || simStop; });
+			if(simStop) return;
+			frameRequested = false;
+			commands.swap(simCommands);
+			frame = simFrame++;
+			inputTime = pendingInputTime;
+			pendingInputTime = -1;
+		}
+		for(size_t c=0; c < commands.size(); c++) commands[c]();
+		if(replaying) {
+			for(const InputEvent* e = inputLog.nextFor(frame); e != NULL; e = inputLog.nextFor(frame)) runInput(*e);
+			if(frame >= inputLog.endFrame) replayDone = true;
+		}
 
-	// Set the texture scale for the shaders
-	glUniform1f( glGetUniformLocation( shaderProgram, "texScale"), sceneObj.texScale );
+		// The only time the clock is read in a frame. The simulation catches up in whole steps.
+		if(replaying) frameClock.tick(inputLog.frameTime(frame, replayFrameTime));
+		else frameClock.tick();
+		while (frameClock.nextStep()) stepSimulation();
+		takeSnapshot(&snapshots[1 - renderSnapshot]);
+		snapshots[1 - renderSnapshot].inputTime = inputTime;
+
+		{
+			lock_guard<mutex> guard(simLock);
+			if(recording) inputLog.writeFrame(frame, frameClock.frameTime); // Under simLock, like postInput
+			snapshotReady = true;
+		}
+		simWake.notify_all();
+	}
+}
+
+// Stop the simulation thread once it finishes its frame, and wait for it. Run at exit, before the
+// globals are destroyed, as destroying simWake while the thread waits on it never returns.
+static void stopSimulation() {
+	if(this_thread::get_id() == simThread.get_id()) { // exit() on the simulation thread, it can't wait for itself
+		simThread.detach();
+		return;
+	}
+	{
+		lock_guard<mutex> guard(simLock);
+		simStop = true;
+	}
+	simWake.notify_all();
+	simThread.join();
+}
+
+// Start the simulation thread, which makes the first snapshot straight away (unless in low latency
+// mode, where each snapshot is asked for when it's drawn)
+void startSimulation() {
+	frameRequested = !lowLatency;
+	simThread = thread(simulationLoop);
+	atexit(stopSimulation);	// Any exit() from here on, e.g. Esc, Quit or the end of a replay
+}
+
+// Wait for the simulation thread's next snapshot, make it renderScene, and let the simulation thread
+// start on the frame after it. Called at the start of display().
+// [GOZ]: In low latency mode the snapshot is only asked for here, so it has the latest input (and
+// camera), at the cost of the simulation no longer running alongside the drawing.
+static void swapSnapshots() {
+	{
+		unique_lock<mutex> waitLock(simLock);
+		if(lowLatency) {
+			frameRequested = true;
+			simWake.notify_all();
+		}
+		simWake.wait(waitLock, []() { return snapshotReady; });
+		snapshotReady = false;
+		renderSnapshot = 1 - renderSnapshot;
+		renderScene = &snapshots[renderSnapshot];
+		if(!lowLatency) frameRequested = true;
+	}
+	simWake.notify_all();
+}
+
+//------Latency -----------------------------------------------------------------
+//
+// [GOZ]: Each frame ends with a fence, which signals when the GPU has finished it. The time from the input
+// a frame first shows (see pendingInputTime) to its fence signalling is its input latency, give or take
+// the swap itself. Fences are only polled once per frame, so this overestimates by up to a frame.
+// With --low-latency=N, display() waits for all but N-1 earlier frames to finish before starting
+// the next, so the driver can't queue frames up behind the one being drawn (the default N is 1).
+
+typedef struct {
+	GLsync fence;
+	double inputTime;	// From the frame's snapshot
+} FrameFence;
+
+deque<FrameFence> frameFences;
+int maxFramesInFlight = 1;
+double latencySum = 0.0, latencyMax = 0.0; // Since the title was last updated
+int latencyCount = 0;
+
+// Collect the latency of the frames the GPU has finished. Called at the start of display(), before it
+// takes the next snapshot, so in low latency mode the snapshot is taken after the wait.
+static void retireFrameFences() {
+	while(!frameFences.empty()) {
+		bool wait = lowLatency && (int)frameFences.size() >= maxFramesInFlight;
+		GLenum status = glClientWaitSync(frameFences.front().fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+				wait ? 1000000000 : 0); // At most a second, in case a frame is lost
+		if(status == GL_TIMEOUT_EXPIRED) return;
+		if(status != GL_WAIT_FAILED && frameFences.front().inputTime >= 0) {
+			double latency = inputClockMs() - frameFences.front().inputTime;
+			latencySum += latency;
+			latencyMax = max(latencyMax, latency);
+			latencyCount++;
+		}
+		glDeleteSync(frameFences.front().fence);
+		frameFences.pop_front();
+	}
+}
+
+// Called just after a frame is submitted
+static void fenceFrame(const SceneSnapshot* sc) {
+	if(!GLEW_ARB_sync) return;
+	FrameFence f = { glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), sc->inputTime };
+	frameFences.push_back(f);
+}
+
+//------Animation LOD -----------------------------------------------------------
+//
+// [GOZ]: Animated objects are posed less often the smaller they appear on screen, with the bone transforms
+// interpolated between poses, and not posed or drawn at all while off screen (their animation time still
+// advances, as it is measured from animStart). Distant objects also only blend their heaviest bone.
+
+const float animLODRate = 60.0; // The intervals below are in frames at this rate
+const int animLODOneBone = 8; // Objects posed this rarely only use VARIANT_SKIN_ONE_BONE
+
+// The radius on screen of a bounding sphere in window pixels, or 0 if it is outside the view frustum.
+// Also used for texture streaming.
+float screenRadius(vec4 centre, float radius) {
+	vec4 c = view * centre;
+	float depth = -c.z;
+	float sx = frustumRight / zNear, sy = frustumTop / zNear; // The sides of the frustum are at |x| = sx * depth
+	if(depth + radius < zNear || depth - radius > zFar) return 0.0;
+	if((fabs(c.x) - sx * depth) / sqrt(1 + sx*sx) > radius) return 0.0;
+	if((fabs(c.y) - sy * depth) / sqrt(1 + sy*sy) > radius) return 0.0;
+	return max(radius / max(depth, zNear) / sy * windowHeight / 2, 1e-3f);
+}
+
+// The number of frames between poses for a bounding sphere, or 0 if the sphere is outside the view frustum.
+int animLODInterval(vec4 centre, float radius) {
+	float pixels = screenRadius(centre, radius);
+	if(pixels == 0.0) return 0;
+	if(pixels >= 150) return 1;
+	if(pixels >= 60) return 2;
+	if(pixels >= 20) return 4;
+	return animLODOneBone;
+}
+
+// [TFD]: POSE_TIME ranges from 0 to numFrames, looping FPC times in one half movement cycle
+static float poseTimeAt(const SceneObject* so, float elapsedTime) {
+	float period = so->moveDist / so->moveSpeed;		// [TFD]: The time taken to complete one movement cycle
+	return fmod((0.5 + 0.5 * sin(elapsedTime / period * 2 * PI))* so->FPC * so->numFrames, so->numFrames);
+}
+
+// Fill boneTransforms with the pose of object i, elapsedTime seconds into its animation, posing it
+// interval frames apart and interpolating in between.
+void animatedPose(int i, float elapsedTime, int interval, mat4* boneTransforms) {
+	const SceneObject* so = &renderScene->objs[i];
+	unsigned int serial = renderScene->serials[i];
+	const MeshData* mesh = meshes[so->meshId];
+	if(interval <= 1) {
+		POSE_TIME = poseTimeAt(so, elapsedTime);
+		evaluatePose(&mesh->skeleton, 0, POSE_TIME, boneTransforms);
+		return;
+	}
+
+	AnimPoseCache* cache = &poseCaches[i];
+	float step = interval / animLODRate;
+	long long sample = (long long)floor(elapsedTime / step);
+	float frac = elapsedTime / step - sample;
+
+	if(cache->serial != serial || cache->interval != interval || cache->sample != sample) {
+		cache->poses[0].resize(mesh->numBones);
+		cache->poses[1].resize(mesh->numBones);
+		if(cache->serial == serial && cache->interval == interval && cache->sample + 1 == sample) {
+			cache->poses[0].swap(cache->poses[1]); // The old next pose is the new previous one
+		} else {
+			POSE_TIME = poseTimeAt(so, sample * step);
+			evaluatePose(&mesh->skeleton, 0, POSE_TIME, &cache->poses[0][0]);
+		}
+		POSE_TIME = poseTimeAt(so, (sample + 1) * step);
+		evaluatePose(&mesh->skeleton, 0, POSE_TIME, &cache->poses[1][0]);
+
+		cache->serial = serial;
+		cache->interval = interval;
+		cache->sample = sample;
+	}
+
+	for(int b=0; b < mesh->numBones; b++)
+		boneTransforms[b] = cache->poses[0][b] * (1.0 - frac) + cache->poses[1][b] * frac;
+}
+
+//----------------------------------------------------------------------------
 
+// [GOZ]: Set the uniforms for an object's texture, material and model-view. Also used for impostors.
+static void setObjectUniforms(const SceneObject& sceneObj, ShaderVariant* v) {
 
-	// Set the projection matrix for the shaders
-	glUniformMatrix4fv( projectionU, 1, GL_TRUE, projection );
+	// Select a layer of the texture array, loading it if needed.
+	// [GOZ]: The array itself is bound once per frame in display. Plain textures just need their colour.
+	if(texPlain[sceneObj.texId] == 1)
+		glUniform3fv( v->texColorU, 1, texPlainColor[sceneObj.texId] );
+	else
+		glUniform1i( v->texLayerU, loadTextureIfNotAlreadyLoaded(sceneObj.texId) );
+
+	// Set the texture scale for the shaders
+	glUniform1f( v->texScaleU, sceneObj.texScale );
+
+	vec3 rgb = sceneObj.rgb * sceneObj.brightness * 4.0; // [TFD]: Base brightness doubled for ease on eyes
+	glUniform3fv( v->ambientProductU, 1, sceneObj.ambient * rgb ); CheckError();
+	glUniform3fv( v->diffuseProductU, 1, sceneObj.diffuse * rgb );
+	glUniform3fv( v->specularProductU, 1, sceneObj.specular * rgb );
+	glUniform1f( v->shininessU, sceneObj.shine ); CheckError();
 
 	// Set the model matrix - this should combine translation, rotation and scaling based on what's
 	// in the sceneObj structure (see near the top of the program).
-	// [GOZ]: PART B. Scale, then Rotate about X, then Y, then Z, then translate.
-	mat4 model = Translate(sceneObj.loc) * RotateZ(sceneObj.angles[2]) * RotateY(sceneObj.angles[1]) * RotateX(sceneObj.angles[0]) * Scale(sceneObj.scale);
+	mat4 model = modelMatrix(sceneObj);
 
 	// Set the model-view matrix for the shaders
-	glUniformMatrix4fv( modelViewU, 1, GL_TRUE, view * model );
+	glUniformMatrix4fv( v->modelViewU, 1, GL_TRUE, view * model );
+}
 
+// [GOZ]: Draw an object with a shader variant. boneTransforms holds the pose for meshes with bones.
+// fade is less than 1 while a static mesh crossfades with its impostor, see Impostors.
+void drawMesh(SceneObject sceneObj, ShaderVariant* v, mat4* boneTransforms, float fade) {
+	setObjectUniforms(sceneObj, v);
+	glUniform1f( v->fadeU, fade );
 
 	// Activate the VAO for a mesh, loading if needed.
 	loadMeshIfNotAlreadyLoaded(sceneObj.meshId); CheckError();
 	glBindVertexArray( vaoIDs[sceneObj.meshId] ); CheckError();
 
 	// [TFD]: part D.B7 direct from instructions
-	int nBones = meshes[sceneObj.meshId]->mNumBones;
-    if(nBones == 0)  nBones = 1;  // If no bones, just a single identity matrix is used
+	// [GOZ]: Meshes without bones use a static variant, which doesn't need any bone transforms
+	int nBones = meshes[sceneObj.meshId]->numBones;
+	if(nBones > 0)
+	    glUniformMatrix4fv(v->boneTransformsU, nBones, GL_TRUE, (const GLfloat *)boneTransforms);
+
+	glDrawElements(GL_TRIANGLES, meshes[sceneObj.meshId]->numFaces * 3, GL_UNSIGNED_INT, NULL); CheckError();
+}
+
+//------Impostors ---------------------------------------------------------------
+//
+// [GOZ]: Static meshes with many triangles are drawn as impostors when they are small on screen. The
+// first time a mesh needs one, it is drawn from impostorGrid x impostorGrid directions into an atlas
+// (vBake.glsl and fBake.glsl), giving the texture coordinate, normal and depth of its surface in each
+// view. The directions are an octahedral map of the sphere around the mesh. An impostor is a card facing
+// the view nearest the camera, lit by fScene.glsl like the mesh, with the object's own texture and
+// material, and with its depth moved to the baked surface. Between impostorSize and impostorFadeBand
+// times it the object crossfades between the two, with complementary dithering.
+// Atlases take the least recently used layer, baking at most impostorBakesPerFrame a frame.
+
+const float impostorFadeBand = 1.25;
+const int impostorMinFaces = 2000; // Meshes with fewer triangles aren't worth an impostor
+const int impostorBakesPerFrame = 1;
+int impostorBakeFrame = -1, impostorBakesThisFrame = 0;
+
+GLuint impostorFBO, impostorDepth, impostorVAO;
+GLuint bakeProgram;
+GLint bakeProjectionU;
+
+void initImpostors() {
+	for(int m=0; m < numMeshes; m++) impostorSlots[m] = -1;
+	for(int s=0; s < numImpostorSlots; s++) slotImpostors[s] = -1;
+	if(impostorSize <= 0) return;
+
+	int atlasSize = impostorGrid * impostorCell;
+	glGenTextures(1, &impostorTexCoords);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, impostorTexCoords);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA16F, atlasSize, atlasSize, numImpostorSlots, 0,
+			GL_RGBA, GL_FLOAT, NULL);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST); // Don't blend across edges
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glGenTextures(1, &impostorNormals);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, impostorNormals);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, atlasSize, atlasSize, numImpostorSlots, 0,
+			GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0); CheckError();
+
+	glGenRenderbuffers(1, &impostorDepth);
+	glBindRenderbuffer(GL_RENDERBUFFER, impostorDepth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, atlasSize, atlasSize);
+	glGenFramebuffers(1, &impostorFBO);
+	glBindFramebuffer(GL_FRAMEBUFFER, impostorFBO);
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, impostorTexCoords, 0, 0);
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, impostorNormals, 0, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, impostorDepth);
+	GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+	glDrawBuffers(2, drawBuffers);
+	if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		printf("Error - incomplete impostor framebuffer\n");
+		exit(1);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0); CheckError();
+
+	glGenVertexArrays(1, &impostorVAO); // Cards have no vertex attributes, see vScene.glsl
+	glBindVertexArray(impostorVAO);
+	glBindVertexArray(0);
+
+	char* vSource = readShaderSource("vBake.glsl");
+	char* fSource = readShaderSource("fBake.glsl");
+	if(vSource == NULL) { fprintf(stderr, "Failed to read vBake.glsl\n"); exit(EXIT_FAILURE); }
+	if(fSource == NULL) { fprintf(stderr, "Failed to read fBake.glsl\n"); exit(EXIT_FAILURE); }
+	bakeProgram = buildProgram("vBake.glsl", vSource, "fBake.glsl", fSource, "");
+	bakeProjectionU = glGetUniformLocation(bakeProgram, "Projection"); CheckError();
+	delete [] vSource;
+	delete [] fSource;
+
+	labelObject(GL_TEXTURE, impostorTexCoords, "Impostor texture coordinates");
+	labelObject(GL_TEXTURE, impostorNormals, "Impostor normals and depth");
+	labelObject(GL_RENDERBUFFER, impostorDepth, "Impostor baking depth");
+	labelObject(GL_FRAMEBUFFER, impostorFBO, "Impostor baking");
+	labelObject(GL_VERTEX_ARRAY, impostorVAO, "Impostor cards");
+	labelObject(GL_PROGRAM, bakeProgram, "Impostor baking");
+}
+
+// The direction for a point in an octahedral map, as octDecode in vScene.glsl
+static vec3 octDecode(float u, float v) {
+	float x = 2.0 * u - 1.0, z = 2.0 * v - 1.0, y = 1.0 - fabs(x) - fabs(z);
+	if(y < 0.0) {
+		float fx = x;
+		x = (1.0 - fabs(z)) * (fx >= 0.0 ? 1.0 : -1.0);
+		z = (1.0 - fabs(fx)) * (z >= 0.0 ? 1.0 : -1.0);
+	}
+	return normalize(vec3(x, y, z));
+}
+
+// Draw mesh m's atlas into layer slot. The mesh must be loaded.
+static void bakeImpostor(int m, int slot) {
+	pushDebugGroup("Impostor baking");
+	glBindFramebuffer(GL_FRAMEBUFFER, impostorFBO);
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, impostorTexCoords, 0, slot);
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, impostorNormals, 0, slot);
+	const GLfloat clearColour[4] = { 0.0, 0.0, 0.0, 0.0 }, clearDepth = 1.0;
+	glClearBufferfv(GL_COLOR, 0, clearColour);
+	glClearBufferfv(GL_COLOR, 1, clearColour);
+	glClearBufferfv(GL_DEPTH, 0, &clearDepth); CheckError();
+
+	glUseProgram(bakeProgram);
+	currVariant = -1;
+	const MeshData* mesh = meshes[m];
+	glBindVertexArray(mesh->baseVertex >= 0 ? indirectVAO : vaoIDs[m]);
+
+	// Each view looks at the origin from direction d, with the same basis as the cards in vScene.glsl
+	float r = meshRadius[m];
+	mat4 ortho = Ortho(-r, r, -r, r, -r, r);
+	for(int cy=0; cy < impostorGrid; cy++) {
+		for(int cx=0; cx < impostorGrid; cx++) {
+			vec3 d = octDecode((cx + 0.5) / impostorGrid, (cy + 0.5) / impostorGrid);
+			vec3 up = fabs(d.y) > 0.999 ? vec3(0.0, 0.0, 1.0) : vec3(0.0, 1.0, 0.0);
+			vec3 right = normalize(cross(up, d));
+			up = cross(d, right);
+			mat4 viewBasis(vec4(right, 0.0), vec4(up, 0.0), vec4(d, 0.0), vec4(0.0, 0.0, 0.0, 1.0));
+			glUniformMatrix4fv(bakeProjectionU, 1, GL_TRUE, ortho * viewBasis);
+			glViewport(cx * impostorCell, cy * impostorCell, impostorCell, impostorCell);
+			if(mesh->baseVertex >= 0)
+				glDrawElementsBaseVertex(GL_TRIANGLES, mesh->numFaces * 3, GL_UNSIGNED_INT,
+						BUFFER_OFFSET(sizeof(GLuint) * mesh->firstIndex), mesh->baseVertex);
+			else
+				glDrawElements(GL_TRIANGLES, mesh->numFaces * 3, GL_UNSIGNED_INT, NULL);
+		}
+	}
+	CheckError();
+
+	glBindFramebuffer(GL_FRAMEBUFFER, dynamicRes ? sceneFBO : 0); // Back to drawing the frame
+	glViewport(0, 0, renderWidth, renderHeight); CheckError();
+	popDebugGroup();
+
+	slotImpostors[slot] = m;
+	impostorSlots[m] = slot;
+	impostorBakes++;
+}
+
+// Whether mesh m has an atlas, baking it if there is a layer that this frame isn't using and the
+// frame hasn't done its bakes yet.
+static bool impostorReady(int m) {
+	int slot = impostorSlots[m];
+	if(slot < 0) {
+		if(impostorBakeFrame != resourceFrame) {
+			impostorBakeFrame = resourceFrame;
+			impostorBakesThisFrame = 0;
+		}
+		if(impostorBakesThisFrame >= impostorBakesPerFrame) return false;
+		for(int s=0; s < numImpostorSlots; s++) {
+			if(slotImpostors[s] < 0) { slot = s; break; }
+			if(impostorLastUsed[s] < resourceFrame && (slot < 0 || impostorLastUsed[s] < impostorLastUsed[slot]))
+				slot = s;
+		}
+		if(slot < 0) return false;
+		if(slotImpostors[slot] >= 0) impostorSlots[slotImpostors[slot]] = -1;
+		bakeImpostor(m, slot);
+		impostorBakesThisFrame++;
+	}
+	impostorLastUsed[slot] = resourceFrame;
+	return true;
+}
+
+// How much of an object is drawn as its mesh rather than its impostor, from 1 (all mesh) down to 0 (all
+// impostor), given its screen radius in render target pixels. Bakes the mesh's atlas if needed.
+float impostorFade(const SceneObject* so, float radius) {
+	if(impostorSize <= 0 || radius <= 0.0 || radius >= impostorSize * impostorFadeBand) return 1.0;
+	const MeshData* mesh = meshes[so->meshId];
+	if(mesh->numBones > 0 || mesh->numFaces < impostorMinFaces || !impostorReady(so->meshId)) return 1.0;
+	return max(0.0f, (radius - impostorSize) / (impostorSize * (impostorFadeBand - 1.0f)));
+}
+
+// Draw the impostors for the n objects in objs (indices into sc->objs), with stencil 0 like drawGPUDriven
+void drawImpostors(const SceneSnapshot* sc, const int* objs, int n, int lightFlags, const float* fades) {
+	if(n == 0) return;
+	pushDebugGroup("Impostors");
+	glActiveTexture(GL_TEXTURE6);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, impostorTexCoords);
+	glActiveTexture(GL_TEXTURE7);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, impostorNormals);
+	glActiveTexture(GL_TEXTURE0);
+	glStencilFunc(GL_ALWAYS, 0, -1);
+	glBindVertexArray(impostorVAO);
+
+	for(int k=0; k < n; k++) {
+		const SceneObject& so = sc->objs[objs[k]];
+		int flags = VARIANT_IMPOSTOR | lightFlags | (isPlainTexture(so.texId) ? 0 : VARIANT_TEXTURED);
+		ShaderVariant* v = useVariant(flags);
+		setObjectUniforms(so, v);
+		glUniform1f(v->fadeU, fades[objs[k]]);
+		glUniform1i(v->impostorLayerU, impostorSlots[so.meshId]);
+		glUniform1f(v->impostorRadiusU, meshRadius[so.meshId]);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
+	CheckError();
+	popDebugGroup();
+}
+
+
+// [GOZ]: Indirectly drawn objects and impostors don't get stencil values, so when none of the other
+// objects is under the mouse they are drawn again with VARIANT_PICK, into the single pixel of pickFBO.
+// Each writes its index in gpuObjs, or nGPU plus its index in impostorObjs, plus one (0 is nothing).
+// The viewport is offset so that the picked pixel lands on pickFBO's pixel, leaving gl_FragCoord (and
+// so the crossfade dithering) as it was, and culling uses a frustum around just that pixel.
+GLuint pickFBO, pickIds, pickDepth;
+
+void initPicking() {
+	if(!gpuDriven && impostorSize <= 0) return;
+	glGenRenderbuffers(1, &pickIds);
+	glBindRenderbuffer(GL_RENDERBUFFER, pickIds);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_R32UI, 1, 1);
+	glGenRenderbuffers(1, &pickDepth);
+	glBindRenderbuffer(GL_RENDERBUFFER, pickDepth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, 1, 1);
+	glGenFramebuffers(1, &pickFBO);
+	glBindFramebuffer(GL_FRAMEBUFFER, pickFBO);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, pickIds);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, pickDepth);
+	if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		printf("Error - incomplete picking framebuffer\n");
+		exit(1);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0); CheckError();
+
+	labelObject(GL_RENDERBUFFER, pickIds, "Picking object IDs");
+	labelObject(GL_RENDERBUFFER, pickDepth, "Picking depth");
+	labelObject(GL_FRAMEBUFFER, pickFBO, "Picking");
+}
+
+// The object (an index into sc->objs) at render target pixel (x, y), out of the nGPU objects in gpuObjs
+// just drawn by drawGPUDriven and the nImpostors in impostorObjs just drawn by drawImpostors, or -1
+int pickObject(const SceneSnapshot* sc, const int* gpuObjs, int nGPU, const int* impostorObjs, int nImpostors,
+		const float* fades, GLint x, GLint y) {
+	if(nGPU == 0 && nImpostors == 0) return -1;
+	if(x < 0 || y < 0 || x >= renderWidth || y >= renderHeight) return -1;
+	pushDebugGroup("Picking");
+	glBindFramebuffer(GL_FRAMEBUFFER, pickFBO);
+	glViewport(-x, -y, renderWidth, renderHeight);
+	GLuint none = 0;
+	glClearBufferuiv(GL_COLOR, 0, &none);
+	glClear(GL_DEPTH_BUFFER_BIT);
+
+	if(nGPU > 0) {
+		// Scale clip space so the pixel fills it, for a frustum that only holds what covers the pixel
+		float cx = 2.0 * (x + 0.5) / renderWidth - 1.0, cy = 2.0 * (y + 0.5) / renderHeight - 1.0;
+		mat4 pixel(vec4(renderWidth, 0.0, 0.0, -renderWidth * cx), vec4(0.0, renderHeight, 0.0, -renderHeight * cy),
+				vec4(0.0, 0.0, 1.0, 0.0), vec4(0.0, 0.0, 0.0, 1.0));
+		cullGPUDriven(pixel * projection, nGPU);
+		drawCulledGPUDriven(VARIANT_INDIRECT | VARIANT_PICK);
+	}
 
-    // get boneTransforms for the first (0th) animation at the given time (a float measured in frames)
-    mat4 boneTransforms[nBones];     // was: mat4 boneTransforms[mesh->mNumBones];
+	if(nImpostors > 0) {
+		glActiveTexture(GL_TEXTURE6);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, impostorTexCoords);
+		glActiveTexture(GL_TEXTURE7);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, impostorNormals);
+		glActiveTexture(GL_TEXTURE0);
+		glBindVertexArray(impostorVAO);
+		ShaderVariant* v = useVariant(VARIANT_IMPOSTOR | VARIANT_PICK);
+		for(int k=0; k < nImpostors; k++) {
+			const SceneObject& so = sc->objs[impostorObjs[k]];
+			glUniformMatrix4fv(v->modelViewU, 1, GL_TRUE, view * modelMatrix(so));
+			glUniform1f(v->fadeU, fades[impostorObjs[k]]);
+			glUniform1i(v->impostorLayerU, impostorSlots[so.meshId]);
+			glUniform1f(v->impostorRadiusU, meshRadius[so.meshId]);
+			glUniform1i(v->pickIdU, nGPU + k + 1);
+			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		}
+		CheckError();
+	}
 
-	calculateAnimPose(meshes[sceneObj.meshId], scenes[sceneObj.meshId], 0, POSE_TIME, boneTransforms);
-    glUniformMatrix4fv(boneTransformsU, nBones, GL_TRUE, (const GLfloat *)boneTransforms);
+	GLuint id;
+	glReadPixels(0, 0, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, &id);
+	glBindFramebuffer(GL_FRAMEBUFFER, dynamicRes ? sceneFBO : 0); // Back to drawing the frame
+	glViewport(0, 0, renderWidth, renderHeight); CheckError();
+	popDebugGroup();
 
-	glDrawElements(GL_TRIANGLES, meshes[sceneObj.meshId]->mNumFaces * 3, GL_UNSIGNED_INT, NULL); CheckError();
+	if(id == 0) return -1;
+	return (int)id <= nGPU ? gpuObjs[id - 1] : impostorObjs[id - nGPU - 1];
 }
 
 
 void display( void )
 {
 	numDisplayCalls++;
-
-	if ( lightSpread > 1.0 ) lightSpread = 1.0;	// [TFD]: Cap spotlight spread
-	else if ( lightSpread < -1.0 ) lightSpread = -1.0;
+	resourceFrame++;
+
+	retireFrameFences();
+	collectDecodedTextures();	// [GOZ]: Textures the workers have decoded since the last frame
+	swapSnapshots();	// [GOZ]: Draw the scene as the simulation thread left it for this frame
+	const SceneSnapshot* sc = renderScene;
+	beginSceneFrame();
+	countResourceRefs();	// [GOZ]: Resources used by this frame's objects can't be evicted
 	
 	glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT );	// [GOZ]: PART J. Stencil for object selection
 	CheckError(); // May report a harmless GL_INVALID_OPERATION with GLEW on the first frame
@@ -521,98 +2985,384 @@ void display( void )
 
 	// [GOZ]: PART A. Create total camera movement matrix M = T*RX*RY
 	// [GOZ]: Rotate around Y for bearing, then X for inclination, then translate away from origin
-	view = Translate(0.0, 0.0, -viewDist) * RotateX(camRotUpAndOverDeg) * RotateY(camRotSidewaysDeg);
-
-
-	SceneObject lightObj1 = sceneObjs[1]; // [TFD]: The actual light is in the middle of the sphere
-	vec4 lightPosition = view * lightObj1.loc;
-	SceneObject lightObj2 = sceneObjs[2];
-	lightObj2.loc.w = 0.0;
-	vec4 light2Position = view * lightObj2.loc;
-
-	vec4 lightRot = view * RotateZ(sceneObjs[1].angles[2]) * RotateY(sceneObjs[1].angles[1]) * RotateX(sceneObjs[1].angles[0]) * vec4( 0.0, 1.0, 0.0, 0.0);
-	glUniform4fv( glGetUniformLocation(shaderProgram, "LightPosition"), 1, lightPosition); CheckError();
-	glUniform4fv( glGetUniformLocation(shaderProgram, "Light2Position"), 1, light2Position); CheckError();
-
-	glUniform3fv( glGetUniformLocation(shaderProgram, "Light1rgbBright"), 1, lightObj1.rgb * lightObj1.brightness );
-	glUniform3fv( glGetUniformLocation(shaderProgram, "Light2rgbBright"), 1, lightObj2.rgb * lightObj2.brightness );
+	view = Translate(0.0, 0.0, -sc->viewDist) * RotateX(sc->camRotUpAndOverDeg) * RotateY(sc->camRotSidewaysDeg);
+
+	// [GOZ]: The actual light is in the middle of each light object.
+	pushDebugGroup("Lighting");
+	gatherLights();
+	binLights();
+	bindLighting();
+	popDebugGroup();
+
+	// Texture unit 0 holds the rgb colour of the surface for every texture, one per layer.
+	// [GOZ]: Bound once here rather than per object. The sampler uniform is set in setFrameUniforms.
+	// [GOZ]: Unit 5 holds the finest mip level loaded in each layer, see streamTextures.
+	glActiveTexture( GL_TEXTURE5 );
+	glBindTexture( GL_TEXTURE_BUFFER, layerMinLevelTexture );
+	glActiveTexture( GL_TEXTURE0 );
+	glBindTexture( GL_TEXTURE_2D_ARRAY, textureArrayID ); CheckError();
+
+	// [GOZ]: Work out each object's shader variant and (for animated objects) LOD, leaving out animated
+	// objects that are off screen. Then sort the objects by shader variant, then mesh, so that program
+	// switches are as few as possible. drawOrder[k] is the k-th object drawn, which is also what the
+	// stencil values below refer to. Animated objects are already moved to this frame's location.
+	// Objects with meshes in the shared buffers are left to drawGPUDriven, and impostors to drawImpostors.
+	static int drawOrder[maxObjects], drawKey[maxObjects], drawVariant[maxObjects], drawPoseInterval[maxObjects];
+	static int gpuObjects[maxObjects], impostorObjs[maxObjects];
+	static float objectFade[maxObjects];
+	int nDraws = 0, nGPUObjects = 0, nImpostors = 0;
+	for(int i=0; i<sc->nObjects; i++) {
+		const SceneObject* so = &sc->objs[i];
+		int flags = variantFor(so);
+		int interval = 1;
+
+		// [GOZ]: Texture streaming and impostors use the screen radius in render target pixels
+		float radius = screenRadius(so->loc, meshRadius[so->meshId] * so->scale) * renderHeight / windowHeight;
+		if (!isPlainTexture(so->texId))	// [GOZ]: See streamTextures. Uses the (smaller) unstretched radius.
+			requestTextureLevel(so->texId, so->texScale, radius);
+
+		objectFade[i] = impostorFade(so, radius);	// [GOZ]: See Impostors
+		if (objectFade[i] < 1.0) impostorObjs[nImpostors++] = i;
+		if (objectFade[i] == 0.0) continue;
+
+		if (meshes[so->meshId]->baseVertex >= 0) {
+			gpuObjects[nGPUObjects++] = i;
+			continue;
+		}
+		
+		if ( so->meshId > 55) {
+			// [GOZ]: The rest pose's radius is stretched a little, as animation can move vertices further out
+			interval = animLODInterval(so->loc, 1.5 * meshRadius[so->meshId] * so->scale);
+			if (interval == 0) continue;
+			if (interval >= animLODOneBone && (flags & VARIANT_SKINNED)) flags |= VARIANT_SKIN_ONE_BONE;
+		}
 
-	glUniform4fv( glGetUniformLocation(shaderProgram, "lightRot"), 1, lightRot); CheckError();
-	glUniform1f( glGetUniformLocation(shaderProgram, "spread"), lightSpread); CheckError();
+		drawVariant[i] = flags;
+		drawKey[i] = flags * numMeshes + so->meshId;
+		drawPoseInterval[i] = interval;
+		drawOrder[nDraws++] = i;
+	}
+	stable_sort(drawOrder, drawOrder + nDraws, [](int a, int b) { return drawKey[a] < drawKey[b]; });
+	streamTextures();
 	
-	mouseObj = -1;
+	int lightFlags = 0;
+	if(nLights > 0) lightFlags |= VARIANT_LIT;
+	if(nLights > 0 && spotlightsOn) lightFlags |= VARIANT_SPOTLIGHTS;
+	drawGPUDriven(sc, gpuObjects, nGPUObjects, lightFlags, objectFade);
+
+	int picked = -1;	// [GOZ]: Only written to mouseObj once the frame is done, as the simulation thread reads it
+	GLint pickX, pickY;
+	windowToRender(sc->mouseX, windowHeight - sc->mouseY - 1, &pickX, &pickY);
 	int stencil = 1;
-	for(int i=0; i<nObjects; i++) {
+	pushDebugGroup("Objects");
+	for(int k=0; k<nDraws; k++) {
+		int i = drawOrder[k];
+		const SceneObject* so = &sc->objs[i];
 		
 		if (stencil > 255) {	// [GOZ]: PART J. Uses the stencil buffer to find what object is currently under the mouse and writes it to mouseObj
 			stencil = 1;
 			GLuint stin;
-			glReadPixels(mouseX, glutGet(GLUT_WINDOW_HEIGHT) - mouseY - 1, 1, 1, GL_STENCIL_INDEX, GL_UNSIGNED_INT, &stin);
+			glReadPixels(pickX, pickY, 1, 1, GL_STENCIL_INDEX, GL_UNSIGNED_INT, &stin);
 			glClear( GL_STENCIL_BUFFER_BIT );
-			if (stin) mouseObj = ((i-1)/255)*255 + stin - 1;
+			if (stin) picked = drawOrder[((k-1)/255)*255 + stin - 1];
 		}
 		glStencilFunc(GL_ALWAYS, stencil++, -1);
-		
-		SceneObject so = sceneObjs[i];
 
-		vec3 rgb = so.rgb * so.brightness * 4.0; // [TFD]: Base brightness doubled for ease on eyes
-		glUniform3fv( glGetUniformLocation(shaderProgram, "AmbientProduct"), 1, so.ambient * rgb ); CheckError();
-		glUniform3fv( glGetUniformLocation(shaderProgram, "DiffuseProduct"), 1, so.diffuse * rgb );
-		glUniform3fv( glGetUniformLocation(shaderProgram, "SpecularProduct"), 1, so.specular * rgb );
-		glUniform1f( glGetUniformLocation(shaderProgram, "Shininess"), so.shine ); CheckError();
-
-		POSE_TIME = 1.0;
-		
-		vec4 displacement = 0.0;
-		
-		if ( sceneObjs[i].meshId > 55) {
-			float elapsedTime = 0.0;
-
-			if (sceneObjs[i].FPC < 0.0) sceneObjs[i].FPC = 0.0;	// [TFD]: Avoid -ve FPC
-			if (sceneObjs[i].moveDist <= 0.0) sceneObjs[i].moveDist = 0.1;	// [TFD]: Avoid dividing by 0
-			if (sceneObjs[i].moveSpeed <= 0.0) sceneObjs[i].moveSpeed = 0.1;
-			
-			if (animationPause != 0) {	// [TFD]: If animation is paused
-				// [TFD]: Time since animation began in seconds (at time of pause)
-				elapsedTime = float ( animationPause - sceneObjs[i].animStart ) / 1000.0;
-			} else {
-				// [TFD]: Time since animation began in seconds
-				elapsedTime =  float ( glutGet(GLUT_ELAPSED_TIME) - sceneObjs[i].animStart ) / 1000.0;	
-			}
-			float period = sceneObjs[i].moveDist / sceneObjs[i].moveSpeed;		// [TFD]: The time taken to complete one movement cycle
-			
-			// [TFD]: POSE_TIME ranges from 0 to numFrames, looping FPC times in one half movement cycle
-			POSE_TIME = fmod((0.5 + 0.5 * sin(elapsedTime / period * 2 * PI))* sceneObjs[i].FPC * sceneObjs[i].numFrames, sceneObjs[i].numFrames);
-			// [TFD]: displacement ranges from 0.5 moveDist to -0.5 moveDist in the direction the object is facing
-			displacement =  RotateZ(sceneObjs[i].angles[2]) * RotateY(sceneObjs[i].angles[1]) * RotateX(sceneObjs[i].angles[0]) * 
-						vec4( 0.0, 0.0, - 0.5 * sceneObjs[i].moveDist * sin(elapsedTime / period * 2 * PI), 0.0);
-			
-			// [TFD]: The displacement is temporarily added to the object's location
-			sceneObjs[i].loc += displacement;
-			
+		ShaderVariant* v = useVariant(drawVariant[i]);
 
+		// get boneTransforms for the first (0th) animation (a float measured in frames)
+		int nBones = meshes[so->meshId]->numBones;
+		mat4 boneTransforms[max(nBones, 1)];
+		if ( nBones > 0 && so->meshId > 55 ) {
+			animatedPose(i, sc->elapsedTime[i], drawPoseInterval[i], boneTransforms);
+		} else if ( nBones > 0 ) {
+			POSE_TIME = 1.0;
+			evaluatePose(&meshes[so->meshId]->skeleton, 0, POSE_TIME, boneTransforms);
 		}
 				
-		drawMesh(sceneObjs[i]);
-		
-			// [TFD]: The objects location is returned to its reset for the next display call
-		sceneObjs[i].loc -= displacement;
-		
+		drawMesh(*so, v, boneTransforms, objectFade[i]);
 	}
+	popDebugGroup();
+	drawImpostors(sc, impostorObjs, nImpostors, lightFlags, objectFade);
 	GLuint stin;
-	glReadPixels(mouseX, glutGet(GLUT_WINDOW_HEIGHT) - mouseY - 1, 1, 1, GL_STENCIL_INDEX, GL_UNSIGNED_INT, &stin);
-	if (stin) mouseObj = 255*((nObjects-1)/255) + stin - 1;
+	glReadPixels(pickX, pickY, 1, 1, GL_STENCIL_INDEX, GL_UNSIGNED_INT, &stin);
+	if (stin) picked = drawOrder[255*((nDraws-1)/255) + stin - 1];
+	if (picked < 0) picked = pickObject(sc, gpuObjects, nGPUObjects, impostorObjs, nImpostors, objectFade, pickX, pickY);
+	mouseObj = picked;
 	
 	//fprintf(stderr, "currObject: %d\tmouseObj: %d\n", currObject, mouseObj);	// [GOZ]: Spams currObject and mouseObj to stderr
 
+	endSceneFrame();
 	glutSwapBuffers();
+	fenceFrame(sc);
+	enforceBudgets();
+
+	// [GOZ]: Time between frames, for the report when recording or replaying input
+	static chrono::steady_clock::time_point lastFrame = chrono::steady_clock::now();
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	if(recording || replaying) frameStats.add(chrono::duration<double, milli>(now - lastFrame).count());
+	lastFrame = now;
+	if(replayDone) exit(EXIT_SUCCESS);	// Reports the frame times, see finishInputLog
+
+}
+
+//------Software rendering --------------------------------------------------------
+//
+// [GOZ]: --software[=N] draws N frames (1 if not given) of the starting scene, or of a saved scene given
+// with --software-scene=FILE, with the rasterizer in softrast.h instead of GL, for machines without a GPU.
+// No window is made. Frames are written to softwareNNNN.ppm, animation runs at replayFrameTime per frame
+// and the rasterizer's per-tile timings are reported at the end. The vertex stage (including blending
+// the bone transforms) and fScene.glsl's shading are done here as native code. Every object is drawn as
+// its full mesh, fully posed, with every texture level loaded, so the images match the GL path's up to
+// its impostors, animation LOD and texture streaming.
+
+int softwareFrames = 0; // Set with --software=N
+char softwareScene[256] = ""; // Set with --software-scene=FILE
+
+void setFrustum( int width, int height ); // See reshape
+
+// Meshes kept in memory for the software renderer, loaded as they are first drawn
+typedef struct {
+	vector<vec3> positions, normals;
+	vector<vec2> texCoords;
+	vector<GLuint> indices;
+	vector<GLint> boneIDs;	// Four per vertex, as in the GL path's buffers
+	vector<GLfloat> boneWeights;
+	int numBones;
+	Skeleton skeleton;
+} SoftMesh;
+
+SoftMesh* softMeshes[numMeshes];
+
+static SoftMesh* loadSoftMesh(int meshNumber) {
+	if(softMeshes[meshNumber] != NULL) return softMeshes[meshNumber];
+
+	const aiScene* scene = loadScene(meshNumber);
+	aiMesh* mesh = scene->mMeshes[0];
+	int nVerts = mesh->mNumVertices;
+	SoftMesh* m = new SoftMesh();
+	m->positions.resize(nVerts);
+	m->normals.resize(nVerts);
+	m->texCoords.resize(nVerts);
+	for(int i=0; i < nVerts; i++) {
+		m->positions[i] = vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
+		m->normals[i] = vec3(mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z);
+		m->texCoords[i] = vec2(mesh->mTextureCoords[0][i].x, mesh->mTextureCoords[0][i].y);
+	}
+	m->indices.resize(mesh->mNumFaces * 3);
+	for(GLuint i=0; i < mesh->mNumFaces; i++)
+		for(int j=0; j < 3; j++) m->indices[i*3+j] = mesh->mFaces[i].mIndices[j];
+
+	m->numBones = mesh->mNumBones;
+	m->boneIDs.resize(4 * nVerts);
+	m->boneWeights.resize(4 * nVerts);
+	getBonesAffectingEachVertex(mesh, (GLint(*)[4])&m->boneIDs[0], (GLfloat(*)[4])&m->boneWeights[0]);
+	buildSkeleton(mesh, scene, &m->skeleton);
+	aiReleaseImport(scene);
+
+	softMeshes[meshNumber] = m;
+	return m;
+}
+
+// Bilinear sample of a mip level of a texture, wrapping as GL_REPEAT does
+static vec3 sampleSoftLevel(int texId, int level, vec2 coord) {
+	int size = texLevelSize(level);
+	const GLubyte* data = texLevelData(texId, level);
+	float u = coord.x * size - 0.5, v = coord.y * size - 0.5;
+	float fu = floor(u), fv = floor(v);
+	int x0 = (int)fu, y0 = (int)fv;
+	float tx = u - fu, ty = v - fv;
+	vec3 texel[2][2];
+	for(int j=0; j < 2; j++) {
+		for(int i=0; i < 2; i++) {
+			int x = ((x0 + i) % size + size) % size, y = ((y0 + j) % size + size) % size;
+			const GLubyte* p = &data[3 * ((size_t)y * size + x)];
+			texel[j][i] = vec3(p[0], p[1], p[2]) / 255.0;
+		}
+	}
+	return (texel[0][0] * (1 - tx) + texel[0][1] * tx) * (1 - ty) + (texel[1][0] * (1 - tx) + texel[1][1] * tx) * ty;
+}
+
+// [GOZ]: As in fScene.glsl, 1 at a light and fading to 0 at its reach
+static float lightWindow(float dist, float reach) {
+	float x = dist / reach;
+	float w = max(0.0f, 1.0f - x*x*x*x);
+	return w * w;
+}
+
+// [GOZ]: fScene.glsl for one object, with trilinear filtering like the texture array's. Every light is
+// shaded, rather than only those binned to the fragment's cluster.
+class SoftObjectShader : public SoftShader {
+public:
+	vec3 shade(const SoftFragment& f) const {
+		vec3 lit(0.0, 0.0, 0.0), specularSum(0.0, 0.0, 0.0);
+		vec3 E = normalize(-f.position);
+		vec3 N = normalize(f.normal);
+
+		for(int l=0; l < nLights; l++) {
+			const LightData& light = lightData[l];
+			int type = (int)light.position.w;
+			vec3 rgb(light.rgbSpread.x, light.rgbSpread.y, light.rgbSpread.z);
+			vec3 Lvec(light.position.x, light.position.y, light.position.z);
+			if(type != LIGHT_DIRECTIONAL) Lvec = Lvec - f.position;
+
+			vec3 L = normalize(Lvec), H = normalize(L + E);
+			if(type == LIGHT_SPOT && dot(L, vec3(light.direction.x, light.direction.y, light.direction.z)) < light.rgbSpread.w)
+				continue;
+
+			vec3 ambient = rgb * ambientProduct;
+			vec3 diffuse = rgb * max(dot(L, N), 0.0f) * diffuseProduct;
+			vec3 specular = rgb * pow(max(dot(N, H), 0.0f), shininess) * specularProduct;
+			if(dot(L, N) < 0.0) specular = vec3(0.0, 0.0, 0.0);
+
+			float dist = length(Lvec);
+			float falloff = type == LIGHT_DIRECTIONAL ? 1.0 : lightWindow(dist, light.direction.w) / (dist / 15 + 1);
+			lit += (ambient + diffuse) * falloff;
+			specularSum += specular * falloff;
+		}
+
+		vec3 color = lit + vec3(0.1, 0.1, 0.1);	// globalAmbient
+		return color * (texId < 0 ? texColor : sampleTexture(f)) + specularSum;
+	}
+
+	int texId; // -1 for a plain texture
+	vec3 texColor;
+	float texScale;
+	vec3 ambientProduct, diffuseProduct, specularProduct;
+	float shininess;
+
+private:
+	// As sampleLayer in fScene.glsl, with every level loaded
+	vec3 sampleTexture(const SoftFragment& f) const {
+		float scale = 2.0 * texScale;
+		vec2 coord = f.texCoord * scale;
+		vec2 dx = f.texCoordDx * (scale * texArraySize), dy = f.texCoordDy * (scale * texArraySize);
+		float lod = 0.5 * log2(max(dot(dx, dx), dot(dy, dy)));
+		lod = min(max(lod, 0.0f), numTexLevels - 1.0f);
+		int level = (int)lod;
+		float t = lod - level;
+		vec3 texel = sampleSoftLevel(texId, level, coord);
+		if(t > 0.0) texel = texel * (1 - t) + sampleSoftLevel(texId, level + 1, coord) * t;
+		return texel;
+	}
+};
+
+// Object i's mesh after the vertex stage of vScene.glsl, posed as display() would
+static void softVertices(int i, const SoftMesh* mesh, vector<SoftVertex>* out) {
+	const SceneObject& so = renderScene->objs[i];
+	mat4 modelView = view * modelMatrix(so);
+
+	vector<mat4> boneTransforms(max(mesh->numBones, 1));
+	if(mesh->numBones > 0)
+		evaluatePose(&mesh->skeleton, 0, so.meshId > 55 ? poseTimeAt(&so, renderScene->elapsedTime[i]) : 1.0,
+				&boneTransforms[0]);
+
+	int nVerts = mesh->positions.size();
+	out->resize(nVerts);
+	const int chunk = 1024;
+	workerPool->parallelFor((nVerts + chunk - 1) / chunk, [&](int c) {
+		for(int v = c * chunk; v < min(nVerts, (c + 1) * chunk); v++) {
+			vec4 position(mesh->positions[v], 1.0);
+			vec4 normal(mesh->normals[v], 0.0);
+			if(mesh->numBones > 0) {
+				const GLint* ids = &mesh->boneIDs[4 * v];
+				const GLfloat* weights = &mesh->boneWeights[4 * v];
+				mat4 boneTransform = boneTransforms[ids[0]] * weights[0] + boneTransforms[ids[1]] * weights[1] +
+						boneTransforms[ids[2]] * weights[2] + boneTransforms[ids[3]] * weights[3];
+				position = boneTransform * position;
+				normal = boneTransform * normal;
+			}
+			vec4 viewPosition = modelView * position;
+			normal = modelView * normal;
+
+			SoftVertex* sv = &(*out)[v];
+			sv->clip = projection * viewPosition;
+			sv->position = vec3(viewPosition.x, viewPosition.y, viewPosition.z);
+			sv->normal = vec3(normal.x, normal.y, normal.z);
+			sv->texCoord = mesh->texCoords[v];
+		}
+	});
+}
+
+// Draw renderScene with the software rasterizer
+static void drawSoftware(SoftRasterizer* raster) {
+	const SceneSnapshot* sc = renderScene;
+	view = Translate(0.0, 0.0, -sc->viewDist) * RotateX(sc->camRotUpAndOverDeg) * RotateY(sc->camRotSidewaysDeg);
+	gatherLights();
+	raster->clear(vec3(0.0, 0.0, 0.0));
+
+	static SoftObjectShader shaders[maxObjects];
+	vector<SoftVertex> vertices;
+	for(int i=0; i < sc->nObjects; i++) {
+		const SceneObject& so = sc->objs[i];
+		SoftMesh* mesh = loadSoftMesh(so.meshId);
+		loadTextureData(so.texId);
+
+		SoftObjectShader* shader = &shaders[i];
+		shader->texId = texPlain[so.texId] == 1 ? -1 : so.texId;
+		shader->texColor = texPlainColor[so.texId];
+		shader->texScale = so.texScale;
+		vec3 rgb = so.rgb * so.brightness * 4.0; // As setObjectUniforms
+		shader->ambientProduct = so.ambient * rgb;
+		shader->diffuseProduct = so.diffuse * rgb;
+		shader->specularProduct = so.specular * rgb;
+		shader->shininess = so.shine;
+
+		softVertices(i, mesh, &vertices);
+		raster->drawTriangles(&vertices[0], &mesh->indices[0], mesh->indices.size(), shader);
+	}
+	raster->render(workerPool);
+}
 
+// Set up the scene without GL, draw --software's frames and exit.
+void renderSoftware() {
+	srand ( randomSeed );
+	aiInit();
+	initTexLevels();
+	for(int i=0; i < numTextures; i++) texPlain[i] = -1;
+	startWorkerPool();
+
+	initScene();
+	if(softwareScene[0] != '\0') {
+		strncpy(saveFile, softwareScene, sizeof(saveFile) - 1);
+		loadSceneFromFile();
+	}
+	prefetchTextures();
+	setFrustum(windowWidth, windowHeight);
+	renderWidth = windowWidth;
+	renderHeight = windowHeight;
+	frameClock.fixedFrameTime = replayFrameTime;
+
+	SoftRasterizer raster(windowWidth, windowHeight);
+	FrameStats softwareStats;
+	for(int frame=0; frame < softwareFrames; frame++) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		frameClock.tick();
+		while (frameClock.nextStep()) stepSimulation();
+		takeSnapshot(&snapshots[0]);
+		renderScene = &snapshots[0];
+		collectDecodedTextures();
+		drawSoftware(&raster);
+		softwareStats.add(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+
+		char fileName[32];
+		sprintf(fileName, "software%04d.ppm", frame);
+		if(!raster.writePPM(fileName)) {
+			printf("Error writing file: %s\n", fileName);
+			exit(1);
+		}
+	}
+	printf("Wrote %d frames to software0000.ppm onwards\n", softwareFrames);
+	softwareStats.report(stdout);
+	raster.report(stdout);
+	exit(EXIT_SUCCESS);
 }
 
 //--------------Menus
 
 static inline void selectObject() {
-	if ( mouseObj >= NUM_LG ) currObject = mouseObj;	// [GOZ]: PART J. Select object under mouse, ignore lights and ground
+	int obj = inputMouseObj;	// [GOZ]: As recorded with the input, and may be older, so check the object still exists
+	if ( obj >= NUM_LG && obj < nObjects ) currObject = obj;	// [GOZ]: PART J. Select object under mouse, ignore lights and ground
 	else if ( currObject < NUM_LG ) return;	// [GOZ]: If there are no objects or no object is selected
 	doRotate();	// [GOZ]: Set current tool to camera.
 }
@@ -628,14 +3378,12 @@ static void texMenu(int id) {
 	clearTool();
 	if(currObject>=0) {
 		sceneObjs[currObject].texId = id;
-		glutPostRedisplay();
 	}
 }
 
 static void groundMenu(int id) {
 	clearTool();
 	sceneObjs[0].texId = id;
-	glutPostRedisplay();
 }
 
 static void saveMenu(int id) {
@@ -661,7 +3409,7 @@ static void lightMenu(int id) {
 				&sceneObjs[1].rgb[2], &sceneObjs[1].brightness, mat2(1.0, 0, 0, 1.0) );
 	} else if(id==72) {
 		setTool(&sceneObjs[1].angles[1], &sceneObjs[1].angles[0], mat2(-400, 0, 0, -200),
-				&sceneObjs[1].brightness, &lightSpread, mat2(1.0, 0, 0, -1.0) );
+				&sceneObjs[1].brightness, &sceneObjs[1].spread, mat2(1.0, 0, 0, -1.0) );
 	} else if(id == 80) {
 		setTool(&sceneObjs[2].loc[0], &sceneObjs[2].loc[2], camRotZ(),
 				&sceneObjs[2].brightness, &sceneObjs[2].loc[1], mat2( 1.0, 0, 0, 10.0) );
@@ -669,6 +3417,13 @@ static void lightMenu(int id) {
 	} else if(id>=81 && id<=84) {
 		setTool(&sceneObjs[2].rgb[0], &sceneObjs[2].rgb[1], mat2(1.0, 0, 0, 1.0),
 				&sceneObjs[2].rgb[2], &sceneObjs[2].brightness, mat2(1.0, 0, 0, 1.0) );
+	} else if(id>=90 && id<=93) {	// [GOZ]: Make the current object a light, or not. Its colour is set via Material.
+		selectObject();
+		if(currObject>=0) sceneObjs[currObject].lightType = id - 90;
+	} else if(id==94) {
+		selectObject();
+		if(currObject>=0) setTool(&sceneObjs[currObject].angles[1], &sceneObjs[currObject].angles[0], mat2(-400, 0, 0, -200),
+				&sceneObjs[currObject].brightness, &sceneObjs[currObject].spread, mat2(1.0, 0, 0, -1.0) );
 	}
 
 	else { printf("Error in lightMenu\n"); exit(1); }
@@ -681,7 +3436,8 @@ static int createArrayMenu(int size, const char menuEntries[][128], void(*menuFn
 	for(int i=0; i<nSubMenus; i++) {
 		subMenus[i] = glutCreateMenu(menuFn);
 		for(int j = i*10+1; j<=min(i*10+10, size); j++)
-			glutAddMenuEntry( menuEntries[j-1] , j); CheckError();
+			glutAddMenuEntry( menuEntries[j-1] , j);
+		CheckError();
 	}
 	int menuId = glutCreateMenu(menuFn);
 
@@ -728,48 +3484,73 @@ static void mainmenu(int id) {
 				&sceneObjs[currObject].moveDist, &sceneObjs[currObject].moveDist, mat2(0, 0, 0, 10) );
 	}
 	if ( id == 61 && currObject>=0) {
-		if(animationPause == 0){	// [TFD]: if animation is not paused begin animation immediately
-			sceneObjs[nObjects].animStart = glutGet(GLUT_ELAPSED_TIME);
-		} else {			// [TFD]: Else begin animation on resume
-			sceneObjs[nObjects].animStart = animationPause;
-		}
-	}
-	if ( id == 62 ) animationPause = glutGet(GLUT_ELAPSED_TIME);	// [TFD]: Pause all animation
-	if ( id == 63 ) {
-		unsigned int animationResume = glutGet(GLUT_ELAPSED_TIME);
-		for (int i = 0; i < nObjects; i++) {
-			sceneObjs[i].animStart += animationResume - animationPause;
-		}
-		animationPause = 0;
+		sceneObjs[currObject].animStart = frameClock.simTime;	// [TFD]: Restart the animation
 	}
+	if ( id == 62 ) frameClock.paused = true;	// [TFD]: Pause all animation
+	if ( id == 63 ) frameClock.paused = false;	// [TFD]: Resume all animation
 	if ( id == 95 ) duplicateObject(currObject);	// [GOZ]: Duplicate Object
 	if ( id == 96 ) deleteObject(currObject);		// [GOZ]: Delete Object
+}
+
+// [GOZ]: EXIT is handled on the GLUT thread, the rest of the main menu on the simulation thread
+static void mainmenuCallback(int id) {
 	if(id == 99) exit(0);
+	postInput(INPUT_MENU, MENU_MAIN, id);
+}
+
+// Run an input event on the simulation thread, posted live or replayed
+static void runInput(const InputEvent& e) {
+	static void (*const menuFns[])(int) = { objectMenu, materialMenu, texMenu, groundMenu, saveMenu, loadMenu,
+			lightMenu, mainmenu }; // Indexed by the MENU_ enum
+	inputMouseObj = e.args[3];	// [GOZ]: For selectObject, the same live or replayed
+	switch(e.type) {
+		case INPUT_CLICK:
+			mouseClick(e.args[0], e.args[1], e.args[2]);
+			break;
+		case INPUT_MOVE:
+		case INPUT_DRAG:
+			mouseX = e.args[0];
+			mouseY = e.args[1];
+			if(e.type == INPUT_DRAG) doToolUpdateXY();
+			break;
+		case INPUT_KEY:	// [GOZ]: Slow down or speed up all animation
+			frameClock.timeScale *= e.args[0] == '[' ? 0.5 : 2.0;
+			printf("Animation speed x%g\n", frameClock.timeScale);
+			break;
+		case INPUT_MENU:
+			menuFns[e.args[0]](e.args[1]);
+			break;
+	}
 }
 
 static void makeMenu() {
-	int objectId = createArrayMenu(numMeshes, objectMenuEntries, objectMenu);
+	int objectId = createArrayMenu(numMeshes, objectMenuEntries, simMenu<MENU_OBJECT>);
 
-	int materialMenuId = glutCreateMenu(materialMenu);
+	int materialMenuId = glutCreateMenu(simMenu<MENU_MATERIAL>);
 	glutAddMenuEntry("R/G/B/All",10);
 	glutAddMenuEntry("Ambient/Diffuse/Specular/Shine",20);
 
-	int texMenuId = createArrayMenu(numTextures, textureMenuEntries, texMenu);
-	int groundMenuId = createArrayMenu(numTextures, textureMenuEntries, groundMenu);
+	int texMenuId = createArrayMenu(numTextures, textureMenuEntries, simMenu<MENU_TEXTURE>);
+	int groundMenuId = createArrayMenu(numTextures, textureMenuEntries, simMenu<MENU_GROUND>);
 
 	char saveMenuEntries[numSaves][128];
 	for(int i=0; i < numSaves; i++) sprintf( saveMenuEntries[i], "%s%d", saveFile, i + 1);
-	int saveMenuID = createArrayMenu(numSaves, saveMenuEntries, saveMenu);
-	int loadMenuID = createArrayMenu(numSaves, saveMenuEntries, loadMenu);
+	int saveMenuID = createArrayMenu(numSaves, saveMenuEntries, simMenu<MENU_SAVE>);
+	int loadMenuID = createArrayMenu(numSaves, saveMenuEntries, simMenu<MENU_LOAD>);
 
-	int lightMenuId = glutCreateMenu(lightMenu);
+	int lightMenuId = glutCreateMenu(simMenu<MENU_LIGHT>);
 	glutAddMenuEntry("Move Light 1",70);
 	glutAddMenuEntry("R/G/B/All Light 1",71);
 	glutAddMenuEntry("Rot/Spread light 1",72);
 	glutAddMenuEntry("Move Light 2",80);
 	glutAddMenuEntry("R/G/B/All Light 2",81);
+	glutAddMenuEntry("Object: Not a Light",90);
+	glutAddMenuEntry("Object: Point Light",91);
+	glutAddMenuEntry("Object: Spotlight",92);
+	glutAddMenuEntry("Object: Directional Light",93);
+	glutAddMenuEntry("Rot/Spread Object's Light",94);
 
-	glutCreateMenu(mainmenu);
+	glutCreateMenu(mainmenuCallback);
 	glutAddMenuEntry("Rotate/Move Camera",50);
 	glutAddSubMenu("Add object", objectId);
 	glutAddMenuEntry("Position/Scale", 41);
@@ -800,27 +3581,28 @@ keyboard( unsigned char key, int x, int y )
 		case 033:
 			exit( EXIT_SUCCESS );
 			break;
+		case 'm':	// [GOZ]: Report which meshes and textures are resident, and how much memory they use
+			printResidency();
+			break;
+		case '[':	// [GOZ]: Slow down or speed up all animation, see runInput
+		case ']':
+			postInput(INPUT_KEY, key);
+			break;
 	}
 }
 
 //----------------------------------------------------------------------------
 
 
+// [GOZ]: Keeps drawing continuously, so changes made on the simulation thread don't need to ask for a redisplay
 void idle( void ) {
 	glutPostRedisplay();
 }
 
 
 
-void reshape( int width, int height ) {
-
-	windowWidth = width;
-	windowHeight = height;
-
-	glViewport(0, 0, width, height);
-
-
-
+// [GOZ]: Set projection and the frustum for a window size. Also used by the software renderer.
+void setFrustum( int width, int height ) {
 	// You'll need to modify this so that the view is similar to that in the sample solution.
 	// In particular: 
 	//   - the view should include "closer" visible objects (slightly tricky)
@@ -830,14 +3612,33 @@ void reshape( int width, int height ) {
 	GLfloat nearDist = 0.02;	
 	// [TFD]: PART D. Scaled by 0.1
 	if ( width < height ) {		// [TFD]: PART E. solution, visibility does not decrease for width < height
-		projection = Frustum(-nearDist, nearDist,
-				-nearDist*(float)height/(float)width, nearDist*(float)height/(float)width,
-				0.2, 1000.0);	// [TFD]: PART D. far scaled by 10
+		frustumRight = nearDist;
+		frustumTop = nearDist*(float)height/(float)width;
 	} else {								// [TFD]: When height <= width as original
-		projection = Frustum(-nearDist*(float)width/(float)height, nearDist*(float)width/(float)height,
-				-nearDist, nearDist,
-				0.2, 1000.0);
+		frustumRight = nearDist*(float)width/(float)height;
+		frustumTop = nearDist;
 	}
+	projection = Frustum(-frustumRight, frustumRight, -frustumTop, frustumTop,
+			zNear, zFar);	// [TFD]: PART D. far scaled by 10
+}
+
+void reshape( int width, int height ) {
+
+	windowWidth = width;
+	windowHeight = height;
+
+	glViewport(0, 0, width, height);
+
+	setFrustum(width, height);
+	buildClusterBounds();	// [GOZ]: The clusters follow the shape of the frustum
+	resizeSceneFBO();
+
+	mat4 p = projection;	// [GOZ]: For placing objects and the mouse tools
+	postToSim([=]() {
+		simProjection = p;
+		toolWindowWidth = width;
+		toolWindowHeight = height;
+	});
 }
 
 void timer(int unused)
@@ -845,16 +3646,62 @@ void timer(int unused)
 	char title[256];
 	sprintf(title, "%s %s: %d Frames Per Second @ %d x %d",
 			lab, programName, numDisplayCalls, windowWidth, windowHeight );
+	if(dynamicRes)	// [GOZ]: Show the size the scene is really drawn at
+		sprintf(title + strlen(title), " (drawn at %d x %d, %.1f ms)", renderWidth, renderHeight, gpuFrameMs);
+	if(latencyCount > 0)	// [GOZ]: See the Latency section
+		sprintf(title + strlen(title), " input latency %.1f ms (max %.1f)", latencySum / latencyCount, latencyMax);
 
 	glutSetWindowTitle(title);
 
 	numDisplayCalls = 0;
+	latencySum = latencyMax = 0.0;
+	latencyCount = 0;
 	glutTimerFunc(1000, timer, 1);
 }
 
 char dirDefault1[] = "models-textures";
 char dirDefault2[] = "/cslinux/examples/CITS3003/project-files/models-textures";
 
+// [GOZ]: Command line options, given as --name=value. Returns false for an unknown option.
+static bool parseOption(const char* arg) {
+	int mb, kb;
+	double scale;
+	float f;
+	if(strcmp(arg, "--dynamic-res") == 0) dynamicRes = true;
+	else if(strcmp(arg, "--no-gpu-driven") == 0) gpuDrivenAllowed = false;
+	else if(strcmp(arg, "--gl-debug-sync") == 0) glDebugSync = true;
+	else if(strcmp(arg, "--texture-benchmark") == 0) textureBenchmark = true;
+	else if(strcmp(arg, "--low-latency") == 0) lowLatency = true;
+	else if(strcmp(arg, "--software") == 0) softwareFrames = 1;
+	else if(sscanf(arg, "--software=%d", &softwareFrames) == 1) softwareFrames = max(1, softwareFrames);
+	else if(strncmp(arg, "--software-scene=", 17) == 0) {
+		strncpy(softwareScene, arg + 17, sizeof(softwareScene) - 1);
+		softwareFrames = max(1, softwareFrames);
+	}
+	else if(sscanf(arg, "--low-latency=%d", &maxFramesInFlight) == 1) {
+		lowLatency = true;
+		maxFramesInFlight = max(1, maxFramesInFlight);
+	}
+	else if(sscanf(arg, "--seed=%u", &randomSeed) == 1) {}
+	else if(sscanf(arg, "--texture-size=%d", &texArraySize) == 1) texArraySize = max(1, texArraySize);
+	else if(sscanf(arg, "--impostor-size=%d", &impostorSize) == 1) {}
+	else if(sscanf(arg, "--texture-upload=%d", &kb) == 1) texUploadBudget = (size_t)kb << 10;
+	else if(strncmp(arg, "--record=", 9) == 0) strncpy(recordFile, arg + 9, sizeof(recordFile) - 1);
+	else if(strncmp(arg, "--replay=", 9) == 0) strncpy(replayFile, arg + 9, sizeof(replayFile) - 1);
+	else if(sscanf(arg, "--dynamic-res=%f", &f) == 1) { dynamicRes = true; targetFrameMs = f; }
+	else if(sscanf(arg, "--res-scale-min=%f", &f) == 1) resScaleMin = f;
+	else if(sscanf(arg, "--res-scale-max=%f", &f) == 1) resScaleMax = f;
+	else if(sscanf(arg, "--vram-budget=%d", &mb) == 1) vramBudget = (size_t)mb << 20;
+	else if(sscanf(arg, "--ram-budget=%d", &mb) == 1) ramBudget = (size_t)mb << 20;
+	else if(sscanf(arg, "--time-scale=%lf", &scale) == 1) frameClock.timeScale = scale;
+	else if(sscanf(arg, "--light-cutoff=%f", &f) == 1) lightReachFraction = max(0.0f, min(f, 1.0f));
+	else if(strncmp(arg, "--shader-cache=", 15) == 0) {
+		strncpy(shaderCacheDir, arg + 15, sizeof(shaderCacheDir) - 1);
+	}
+	else return false;
+	return true;
+}
+
 void fileErr(char* fileName) {
 	printf("Error reading file: %s\n", fileName);
 	printf("When not in the CSSE labs, you will need to include the directory containing\n");
@@ -869,16 +3716,30 @@ int main( int argc, char* argv[] )
 	for(char *cpointer = argv[0]; *cpointer != 0; cpointer++)
 		if(*cpointer == '/' || *cpointer == '\\') programName = cpointer+1;
 
+	// [GOZ]: Arguments starting with -- are options, see parseOption
+	randomSeed = time(NULL);
+	char *dirArg = NULL;
+	for(int i=1; i < argc; i++) {
+		if(strncmp(argv[i], "--", 2) != 0) dirArg = argv[i];
+		else if(!parseOption(argv[i])) {
+			printf("Unknown option: %s\n", argv[i]);
+			exit(1);
+		}
+	}
+
 	// Set the models-textures directory, via the first argument or two defaults.
-	if(argc>1)
-		strcpy(dataDir, argv[1]);
+	if(dirArg)
+		strcpy(dataDir, dirArg);
 	else if(opendir(dirDefault1))
 		strcpy(dataDir, dirDefault1);
 	else if(opendir(dirDefault2))
 		strcpy(dataDir, dirDefault2);
 	else fileErr(dirDefault1);
+	if(textureBenchmark) benchmarkTextureDecode();
 
 	strcpy(saveFile, saveDefault);
+	if(softwareFrames > 0) renderSoftware();	// [GOZ]: Draws without GL and exits, see Software rendering
+	startInputLog();	// [GOZ]: Before the window is created, as a replay sets its size
 
 	glutInit( &argc, argv );
 	glutInitDisplayMode( GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH | GLUT_STENCIL );	// [GOZ]: PART J. Stencil for object selection
@@ -887,6 +3748,9 @@ int main( int argc, char* argv[] )
 	glutInitContextVersion( 3, 2);
 	//glutInitContextProfile( GLUT_CORE_PROFILE );        // May cause issues, sigh, but you
 	glutInitContextProfile( GLUT_COMPATIBILITY_PROFILE ); // should still use only OpenGL 3.2 Core
+#ifndef NDEBUG
+	glutInitContextFlags( GLUT_DEBUG );	// [GOZ]: For KHR_debug messages, see gldebug.h
+#endif
 	// features.
 	glutCreateWindow( "Initialising..." );
 
@@ -908,6 +3772,8 @@ int main( int argc, char* argv[] )
 
 	makeMenu(); CheckError();
 
+	startSimulation();	// [GOZ]: From here on the scene belongs to the simulation thread
+
 	glutMainLoop();
 	return 0;
 }
@@ -0,0 +1,254 @@
+// [GOZ]: Compact skeletons and animations, converted from an aiScene when a mesh is loaded so that the
+// aiScene can be released. Used in place of gnatidread2.h's calculateAnimPose, which walks the aiScene's
+// node tree for every bone and needs the whole scene kept.
+//
+// The nodes on the paths from the root to the mesh's bones are stored in a flat array, parents before
+// children, so a pose is one pass over it. Each animation's keys are kept in contiguous arrays, one run
+// per channel, with rotations quantized to 16 bits per component. Keys that can be interpolated from
+// their neighbours to within a small error are dropped.
+
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+
+// A rotation key's quaternion, each component scaled to [-32767, 32767]
+typedef struct {
+    short w, x, y, z;
+} QuantQuat;
+
+typedef struct {
+    int firstPos, numPos; // The channel's run of posTimes and posValues
+    int firstRot, numRot; // The channel's run of rotTimes and rotValues
+} AnimChannel;
+
+typedef struct {
+    std::vector<int> nodeChannels; // For each skeleton node, its index in channels, or -1 if it isn't animated
+    std::vector<AnimChannel> channels;
+    std::vector<float> posTimes, rotTimes; // In the same units as calculateAnimPose's poseTime
+    std::vector<vec3> posValues;
+    std::vector<QuantQuat> rotValues;
+} SkeletonAnim;
+
+typedef struct {
+    int numNodes;
+    std::vector<int> parents; // Index of each node's parent, which is always lower, or -1 for the root
+    std::vector<mat4> restTransforms; // Each node's transform relative to its parent when not animated
+    std::vector<int> boneNodes; // The node of each of the mesh's bones
+    std::vector<mat4> boneOffsets; // Each bone's transform from the mesh to the bone
+    std::vector<SkeletonAnim> anims;
+
+    int keysBefore, keysAfter; // Numbers of keys before and after reduction
+} Skeleton;
+
+const float posKeyTolerance = 1e-4; // Largest position error from dropping keys, relative to the skeleton's size
+const float rotKeyTolerance = 1e-3; // Largest rotation error from dropping keys, in radians
+
+static mat4 aiToMat4(const aiMatrix4x4& m) {
+    return mat4(vec4(m.a1, m.a2, m.a3, m.a4), vec4(m.b1, m.b2, m.b3, m.b4),
+                vec4(m.c1, m.c2, m.c3, m.c4), vec4(m.d1, m.d2, m.d3, m.d4));
+}
+
+static vec4 quatLerp(const vec4& a, const vec4& b, float t) { return a * (1.0f - t) + b * t; }
+
+// Spherical interpolation of quaternions stored as (w, x, y, z), as in aiQuaternion::Interpolate
+static vec4 quatSlerp(const vec4& a, vec4 b, float t) {
+    float cosom = dot(a, b);
+    if(cosom < 0.0f) { cosom = -cosom; b = -b; }
+    if(1.0f - cosom <= 1e-6f) return quatLerp(a, b, t);
+    float omega = acosf(cosom), sinom = sinf(omega);
+    return a * (sinf((1.0f - t) * omega) / sinom) + b * (sinf(t * omega) / sinom);
+}
+
+// The angle between two rotations
+static float quatAngle(const vec4& a, const vec4& b) {
+    float d = fabsf(dot(a, b)) / (length(a) * length(b));
+    return 2.0f * acosf(d < 1.0f ? d : 1.0f);
+}
+
+static QuantQuat quantizeQuat(vec4 q) {
+    q = q / length(q);
+    QuantQuat r = { (short)lroundf(q.x * 32767), (short)lroundf(q.y * 32767),
+                    (short)lroundf(q.z * 32767), (short)lroundf(q.w * 32767) };
+    return r;
+}
+
+static vec4 dequantizeQuat(const QuantQuat& q) { return vec4(q.w, q.x, q.y, q.z) / 32767.0f; }
+
+// The rotation matrix of a unit quaternion (w, x, y, z), as in aiQuaternion::GetMatrix
+static mat4 quatMatrix(const vec4& q) {
+    float w = q.x, x = q.y, y = q.z, z = q.w;
+    return mat4(vec4(1 - 2*(y*y + z*z), 2*(x*y - w*z), 2*(x*z + w*y), 0),
+                vec4(2*(x*y + w*z), 1 - 2*(x*x + z*z), 2*(y*z - w*x), 0),
+                vec4(2*(x*z - w*y), 2*(y*z + w*x), 1 - 2*(x*x + y*y), 0),
+                vec4(0, 0, 0, 1));
+}
+
+// Indices of the keys to keep, such that interpolating between kept keys is within tolerance of every
+// dropped key. err(a, b, i) is the error at key i when interpolating between keys a and b.
+template<typename ErrFn>
+static std::vector<int> reduceKeys(int n, const ErrFn& err) {
+    std::vector<int> kept;
+    if(n == 0) return kept;
+    kept.push_back(0);
+    int a = 0;
+    for(int i=1; i+1 < n; i++) {
+        bool droppable = true;
+        for(int j=a+1; j <= i && droppable; j++) droppable = err(a, i+1, j);
+        if(!droppable) { kept.push_back(i); a = i; }
+    }
+    if(n > 1) kept.push_back(n-1);
+    return kept;
+}
+
+static float keyWeight(float t0, float t1, float t) {
+    if(t1 <= t0) return 0.0f;
+    float w = (t - t0) / (t1 - t0);
+    return w < 0.0f ? 0.0f : w > 1.0f ? 1.0f : w;
+}
+
+// Convert animation channel ch into anim, dropping keys within tolerance
+static void addChannel(SkeletonAnim* anim, const aiNodeAnim* ch, float posTolerance, int* keysBefore) {
+    AnimChannel c;
+    const aiVectorKey* pk = ch->mPositionKeys;
+    std::vector<vec3> positions(ch->mNumPositionKeys);
+    for(unsigned int k=0; k < ch->mNumPositionKeys; k++)
+        positions[k] = vec3(pk[k].mValue.x, pk[k].mValue.y, pk[k].mValue.z);
+    std::vector<int> pos = reduceKeys(ch->mNumPositionKeys, [&](int a, int b, int i) {
+        float w = keyWeight(pk[a].mTime, pk[b].mTime, pk[i].mTime);
+        return length(positions[a] * (1.0f - w) + positions[b] * w - positions[i]) <= posTolerance;
+    });
+    c.firstPos = anim->posTimes.size();
+    c.numPos = pos.size();
+    for(size_t k=0; k < pos.size(); k++) {
+        anim->posTimes.push_back(pk[pos[k]].mTime);
+        anim->posValues.push_back(positions[pos[k]]);
+    }
+
+    const aiQuatKey* rk = ch->mRotationKeys;
+    std::vector<vec4> quats(ch->mNumRotationKeys);
+    for(unsigned int k=0; k < ch->mNumRotationKeys; k++)
+        quats[k] = dequantizeQuat(quantizeQuat(vec4(rk[k].mValue.w, rk[k].mValue.x, rk[k].mValue.y, rk[k].mValue.z)));
+    std::vector<int> rot = reduceKeys(ch->mNumRotationKeys, [&](int a, int b, int i) {
+        float w = keyWeight(rk[a].mTime, rk[b].mTime, rk[i].mTime);
+        return quatAngle(quatSlerp(quats[a], quats[b], w), quats[i]) <= rotKeyTolerance;
+    });
+    c.firstRot = anim->rotTimes.size();
+    c.numRot = rot.size();
+    for(size_t k=0; k < rot.size(); k++) {
+        anim->rotTimes.push_back(rk[rot[k]].mTime);
+        anim->rotValues.push_back(quantizeQuat(quats[rot[k]]));
+    }
+
+    anim->channels.push_back(c);
+    *keysBefore += ch->mNumPositionKeys + ch->mNumRotationKeys;
+}
+
+// Add node and its ancestors to the skeleton, parents first, returning node's index
+static int addSkeletonNode(Skeleton* sk, const aiNode* node, std::map<const aiNode*, int>* nodeIds) {
+    std::map<const aiNode*, int>::iterator found = nodeIds->find(node);
+    if(found != nodeIds->end()) return found->second;
+    int parent = node->mParent ? addSkeletonNode(sk, node->mParent, nodeIds) : -1;
+    sk->parents.push_back(parent);
+    sk->restTransforms.push_back(aiToMat4(node->mTransformation));
+    (*nodeIds)[node] = sk->numNodes;
+    return sk->numNodes++;
+}
+
+// Convert the bones of mesh and the animations of scene, which can then be released
+void buildSkeleton(const aiMesh* mesh, const aiScene* scene, Skeleton* sk) {
+    std::map<const aiNode*, int> nodeIds;
+    sk->numNodes = 0;
+    for(unsigned int b=0; b < mesh->mNumBones; b++) {
+        const aiBone* bone = mesh->mBones[b];
+        const aiNode* node = scene->mRootNode->FindNode(bone->mName);
+        if(node == NULL) fail("No node for bone:", (char*)bone->mName.data);
+        sk->boneNodes.push_back(addSkeletonNode(sk, node, &nodeIds));
+        sk->boneOffsets.push_back(aiToMat4(bone->mOffsetMatrix));
+    }
+
+    // The skeleton's size, for the position tolerance
+    float size = 0.0;
+    for(int n=0; n < sk->numNodes; n++) {
+        const mat4& m = sk->restTransforms[n];
+        size = std::max(size, length(vec3(m[0][3], m[1][3], m[2][3])));
+    }
+    float posTolerance = posKeyTolerance * (size > 0.0 ? size : 1.0);
+
+    sk->keysBefore = sk->keysAfter = 0;
+    for(unsigned int a=0; a < scene->mNumAnimations; a++) {
+        const aiAnimation* aiAnim = scene->mAnimations[a];
+        sk->anims.push_back(SkeletonAnim());
+        SkeletonAnim* anim = &sk->anims.back();
+        anim->nodeChannels.assign(sk->numNodes, -1);
+        for(unsigned int c=0; c < aiAnim->mNumChannels; c++) {
+            const aiNode* node = scene->mRootNode->FindNode(aiAnim->mChannels[c]->mNodeName);
+            std::map<const aiNode*, int>::iterator found = nodeIds.find(node);
+            if(found == nodeIds.end()) continue; // Doesn't move any of the mesh's bones
+            anim->nodeChannels[found->second] = anim->channels.size();
+            addChannel(anim, aiAnim->mChannels[c], posTolerance, &sk->keysBefore);
+        }
+        sk->keysAfter += anim->posTimes.size() + anim->rotTimes.size();
+    }
+}
+
+// The index of the key to interpolate from at time t, in a run of n key times
+static int findKey(const float* times, int n, float t) {
+    return std::max(0, (int)(std::upper_bound(times, times + n, t) - times) - 1);
+}
+
+// Fill boneTransforms with the pose of the skeleton poseTime into animation animNum.
+// Matches calculateAnimPose: animated nodes take their channel's rotation and position, without scaling.
+void evaluatePose(const Skeleton* sk, int animNum, float poseTime, mat4* boneTransforms) {
+    if(animNum >= (int)sk->anims.size()) failInt("No animation with number:", animNum);
+    const SkeletonAnim* anim = &sk->anims[animNum];
+    mat4 globals[sk->numNodes];
+
+    for(int n=0; n < sk->numNodes; n++) {
+        mat4 local = sk->restTransforms[n];
+        int c = anim->nodeChannels[n];
+        if(c >= 0) {
+            const AnimChannel& ch = anim->channels[c];
+            if(ch.numRot > 0) {
+                const float* times = &anim->rotTimes[ch.firstRot];
+                const QuantQuat* keys = &anim->rotValues[ch.firstRot];
+                int k = findKey(times, ch.numRot, poseTime);
+                vec4 q = dequantizeQuat(keys[k]);
+                if(k+1 < ch.numRot)
+                    q = quatSlerp(q, dequantizeQuat(keys[k+1]), keyWeight(times[k], times[k+1], poseTime));
+                vec3 t(local[0][3], local[1][3], local[2][3]);
+                local = quatMatrix(q / length(q));
+                local[0][3] = t.x; local[1][3] = t.y; local[2][3] = t.z;
+            }
+            if(ch.numPos > 0) {
+                const float* times = &anim->posTimes[ch.firstPos];
+                const vec3* keys = &anim->posValues[ch.firstPos];
+                int k = findKey(times, ch.numPos, poseTime);
+                vec3 p = keys[k];
+                if(k+1 < ch.numPos) {
+                    float w = keyWeight(times[k], times[k+1], poseTime);
+                    p = p * (1.0f - w) + keys[k+1] * w;
+                }
+                local[0][3] = p.x; local[1][3] = p.y; local[2][3] = p.z;
+            }
+        }
+        globals[n] = sk->parents[n] < 0 ? local : globals[sk->parents[n]] * local;
+    }
+
+    for(size_t b=0; b < sk->boneNodes.size(); b++)
+        boneTransforms[b] = globals[sk->boneNodes[b]] * sk->boneOffsets[b];
+}
+
+// Bytes of memory used by a skeleton and its animations
+size_t skeletonBytes(const Skeleton* sk) {
+    size_t bytes = sizeof(Skeleton) + sk->numNodes * (sizeof(int) + sizeof(mat4)) +
+            sk->boneNodes.size() * (sizeof(int) + sizeof(mat4));
+    for(size_t a=0; a < sk->anims.size(); a++) {
+        const SkeletonAnim* anim = &sk->anims[a];
+        bytes += sizeof(SkeletonAnim) + anim->nodeChannels.size() * sizeof(int) +
+                anim->channels.size() * sizeof(AnimChannel) +
+                anim->posTimes.size() * (sizeof(float) + sizeof(vec3)) +
+                anim->rotTimes.size() * (sizeof(float) + sizeof(QuantQuat));
+    }
+    return bytes;
+}
@@ -0,0 +1,342 @@
+// A multithreaded tile-based software rasterizer, for drawing on machines without a GPU.
+// [GOZ]: Used by scene.cpp for --software, which does the vertex stage and fScene.glsl's shading as native
+// code (see Software rendering in scene.cpp). Needs Angel.h and threadpool.h.
+//
+// Triangles are clipped to the near plane, set up and binned into the screen tiles their bounding boxes
+// touch as they are drawn. render() then rasterizes the tiles on a ThreadPool. Each tile takes its
+// triangles in the order they were drawn, and no two tiles share a pixel, so the threads need no locks.
+// Pixels are tested against the triangle's edge functions and the depth buffer four at a time, with SSE2
+// when the compiler targets it. Coordinates are GL window coordinates, with y up, and depth is in [0, 1]
+// and tested with GL_LESS, as in the GL path. Both faces of triangles are drawn, as GL_CULL_FACE is off.
+
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define SOFTRAST_SSE2
+#endif
+
+// A vertex from the vertex stage: its clip space position, and what is interpolated across triangles
+struct SoftVertex {
+    vec4 clip;
+    vec3 position; // View space
+    vec3 normal;
+    vec2 texCoord;
+};
+
+// What the shader gets for a pixel: the vertex values interpolated with perspective correction, and the
+// texture coordinate's change per pixel in x and y, which GL would give as dFdx and dFdy.
+struct SoftFragment {
+    int x, y;
+    vec3 position, normal;
+    vec2 texCoord, texCoordDx, texCoordDy;
+};
+
+class SoftShader {
+public:
+    virtual ~SoftShader() {}
+
+    // The colour of a fragment, which is clamped to [0, 1]. Called from all of render()'s threads at once.
+    virtual vec3 shade(const SoftFragment& f) const = 0;
+};
+
+class SoftRasterizer {
+public:
+    // tileSize must be a multiple of 4, so that each group of four pixels is in one tile.
+    SoftRasterizer(int width, int height, int tileSize = 32) : width(width), height(height),
+            stride((width + 3) & ~3), tileSize(tileSize), tilesX((width + tileSize - 1) / tileSize),
+            tilesY((height + tileSize - 1) / tileSize), color((size_t)3 * stride * height),
+            depth((size_t)stride * height), bins(tilesX * tilesY), tileMs(tilesX * tilesY, 0.0),
+            tileMaxMs(tilesX * tilesY, 0.0), tileTriangles(tilesX * tilesY, 0), frames(0), threads(1),
+            setupMs(0.0), renderMs(0.0) {}
+
+    // Start a frame: clear the colour and depth buffers and forget the last frame's triangles.
+    void clear(const vec3& background) {
+        for(size_t p=0; p < color.size(); p += 3) {
+            color[p] = toByte(background.x);
+            color[p + 1] = toByte(background.y);
+            color[p + 2] = toByte(background.z);
+        }
+        std::fill(depth.begin(), depth.end(), 1.0f);
+        triangles.clear();
+        for(size_t t=0; t < bins.size(); t++) bins[t].clear();
+    }
+
+    // Draw triangles from nIndices indices into vertices. The vertices are copied, but the shader is only
+    // used in render(), so must last until then.
+    void drawTriangles(const SoftVertex* vertices, const unsigned int* indices, int nIndices, const SoftShader* shader) {
+        Clock::time_point start = Clock::now();
+        for(int i=0; i+2 < nIndices; i += 3)
+            clipTriangle(vertices[indices[i]], vertices[indices[i + 1]], vertices[indices[i + 2]], shader);
+        setupMs += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    // Rasterize and shade every tile, spread over pool's threads and the calling thread.
+    void render(ThreadPool* pool) {
+        Clock::time_point start = Clock::now();
+        pool->parallelFor(tilesX * tilesY, [this](int tile) {
+            Clock::time_point tileStart = Clock::now();
+            rasterizeTile(tile);
+            double ms = std::chrono::duration<double, std::milli>(Clock::now() - tileStart).count();
+            tileMs[tile] += ms;
+            tileMaxMs[tile] = std::max(tileMaxMs[tile], ms);
+            tileTriangles[tile] += bins[tile].size();
+        });
+        renderMs += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        threads = pool->size() + 1;
+        frames++;
+    }
+
+    // Write the colour buffer as a binary PPM, returning false if the file can't be written.
+    bool writePPM(const char* fileName) const {
+        FILE* fp = fopen(fileName, "wb");
+        if(fp == NULL) return false;
+        fprintf(fp, "P6\n%d %d\n255\n", width, height);
+        for(int y = height - 1; y >= 0; y--) fwrite(&color[(size_t)3 * stride * y], 3, width, fp); // Top row first
+        fclose(fp);
+        return true;
+    }
+
+    // Report the time spent setting up triangles and rendering tiles, and the tiles that took longest,
+    // averaged over the frames rendered so far.
+    void report(FILE* out) const {
+        if(frames == 0) return;
+        int nTiles = tilesX * tilesY;
+        double total = 0.0;
+        for(int t=0; t < nTiles; t++) total += tileMs[t];
+        fprintf(out, "Software rendering %d x %d in %d x %d tiles of %d pixels on %d threads, over %d frames\n",
+                width, height, tilesX, tilesY, tileSize, threads, frames);
+        fprintf(out, "Per frame (ms): triangle setup %.2f, tiles %.2f (%.2f of work, %.1fx parallel)\n",
+                setupMs / frames, renderMs / frames, total / frames, total / std::max(renderMs, 1e-9));
+
+        std::vector<int> slowest(nTiles);
+        for(int t=0; t < nTiles; t++) slowest[t] = t;
+        int nSlowest = std::min(nTiles, 5);
+        std::partial_sort(slowest.begin(), slowest.begin() + nSlowest, slowest.end(),
+                [this](int a, int b) { return tileMs[a] > tileMs[b]; });
+        fprintf(out, "Tile times per frame (ms): mean %.3f, slowest tile %.3f (%.1fx the mean)\n",
+                total / frames / nTiles, tileMs[slowest[0]] / frames, tileMs[slowest[0]] / std::max(total / nTiles, 1e-9));
+        fprintf(out, "Slowest tiles (x, y from the bottom left):");
+        for(int i=0; i < nSlowest; i++) {
+            int t = slowest[i];
+            fprintf(out, " (%d, %d) %.3f ms max %.3f ms %lld triangles", t % tilesX, t / tilesX,
+                    tileMs[t] / frames, tileMaxMs[t], tileTriangles[t] / frames);
+            if(i + 1 < nSlowest) fprintf(out, ",");
+        }
+        fprintf(out, "\n");
+    }
+
+    const int width, height;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // A triangle after setup. The edge functions a*x + b*y + c give each vertex's barycentric weight, and
+    // are scaled so that the weights add up to 1 inside the triangle.
+    struct Triangle {
+        float a[3], b[3], c[3];
+        bool topLeft[3]; // Whether pixels exactly on the edge opposite each vertex are inside
+        float z[3], invW[3];
+        float dD[2], dU[2], dV[2]; // Change in sum(weight/w), sum(weight*u/w) and sum(weight*v/w) per pixel
+        SoftVertex v[3];
+        const SoftShader* shader;
+        int minX, minY, maxX, maxY; // Pixels touched by the bounding box, within the screen
+    };
+
+    static unsigned char toByte(float f) {
+        return (unsigned char)(std::min(std::max(f, 0.0f), 1.0f) * 255.0f + 0.5f);
+    }
+
+    static SoftVertex lerpVertex(const SoftVertex& a, const SoftVertex& b, float t) {
+        SoftVertex r;
+        r.clip = a.clip + (b.clip - a.clip) * t;
+        r.position = a.position + (b.position - a.position) * t;
+        r.normal = a.normal + (b.normal - a.normal) * t;
+        r.texCoord = a.texCoord + (b.texCoord - a.texCoord) * t;
+        return r;
+    }
+
+    // Clip a triangle to the near plane (z >= -w), giving up to two triangles to set up. The other planes
+    // are left to the bounding box and the depth test.
+    void clipTriangle(const SoftVertex& v0, const SoftVertex& v1, const SoftVertex& v2, const SoftShader* shader) {
+        const SoftVertex* in[3] = { &v0, &v1, &v2 };
+        float dist[3];
+        int nInside = 0;
+        for(int i=0; i < 3; i++) {
+            dist[i] = in[i]->clip.z + in[i]->clip.w;
+            nInside += dist[i] >= 0.0f;
+        }
+        if(nInside == 3) {
+            setupTriangle(v0, v1, v2, shader);
+            return;
+        }
+        if(nInside == 0) return;
+
+        SoftVertex out[4];
+        int nOut = 0;
+        for(int i=0; i < 3; i++) {
+            int j = (i + 1) % 3;
+            if(dist[i] >= 0.0f) out[nOut++] = *in[i];
+            if((dist[i] >= 0.0f) != (dist[j] >= 0.0f))
+                out[nOut++] = lerpVertex(*in[i], *in[j], dist[i] / (dist[i] - dist[j]));
+        }
+        for(int i=1; i+1 < nOut; i++) setupTriangle(out[0], out[i], out[i + 1], shader);
+    }
+
+    void setupTriangle(const SoftVertex& v0, const SoftVertex& v1, const SoftVertex& v2, const SoftShader* shader) {
+        Triangle t;
+        t.v[0] = v0;
+        t.v[1] = v1;
+        t.v[2] = v2;
+        float x[3], y[3];
+        for(int i=0; i < 3; i++) {
+            const vec4& clip = t.v[i].clip;
+            t.invW[i] = 1.0f / clip.w;
+            x[i] = (clip.x * t.invW[i] * 0.5f + 0.5f) * width;
+            y[i] = (clip.y * t.invW[i] * 0.5f + 0.5f) * height;
+            t.z[i] = clip.z * t.invW[i] * 0.5f + 0.5f;
+        }
+
+        float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]); // Twice the area
+        if(!(std::fabs(area) > 0.0f) || !std::isfinite(area)) return;
+        if(area < 0.0f) { // Clockwise, so reverse it to make the edge functions positive inside
+            std::swap(t.v[1], t.v[2]);
+            std::swap(t.invW[1], t.invW[2]);
+            std::swap(t.z[1], t.z[2]);
+            std::swap(x[1], x[2]);
+            std::swap(y[1], y[2]);
+            area = -area;
+        }
+
+        for(int i=0; i < 3; i++) {
+            int j = (i + 1) % 3, k = (i + 2) % 3;
+            float dx = x[k] - x[j], dy = y[k] - y[j];
+            t.a[i] = -dy / area;
+            t.b[i] = dx / area;
+            t.c[i] = (dy * x[j] - dx * y[j]) / area;
+            t.topLeft[i] = dy < 0.0f || (dy == 0.0f && dx < 0.0f);
+        }
+        for(int axis=0; axis < 2; axis++) {
+            const float* e = axis == 0 ? t.a : t.b;
+            t.dD[axis] = t.dU[axis] = t.dV[axis] = 0.0f;
+            for(int i=0; i < 3; i++) {
+                t.dD[axis] += e[i] * t.invW[i];
+                t.dU[axis] += e[i] * t.invW[i] * t.v[i].texCoord.x;
+                t.dV[axis] += e[i] * t.invW[i] * t.v[i].texCoord.y;
+            }
+        }
+        t.shader = shader;
+
+        float lowX = std::min(x[0], std::min(x[1], x[2])), highX = std::max(x[0], std::max(x[1], x[2]));
+        float lowY = std::min(y[0], std::min(y[1], y[2])), highY = std::max(y[0], std::max(y[1], y[2]));
+        if(highX < 0.0f || highY < 0.0f || lowX > width || lowY > height) return;
+        t.minX = (int)std::floor(std::max(lowX, 0.0f));
+        t.minY = (int)std::floor(std::max(lowY, 0.0f));
+        t.maxX = std::min(width - 1, (int)std::ceil(std::min(highX, (float)width)));
+        t.maxY = std::min(height - 1, (int)std::ceil(std::min(highY, (float)height)));
+
+        int index = triangles.size();
+        triangles.push_back(t);
+        for(int ty = t.minY / tileSize; ty <= t.maxY / tileSize; ty++)
+            for(int tx = t.minX / tileSize; tx <= t.maxX / tileSize; tx++)
+                bins[tx + tilesX * ty].push_back(index);
+    }
+
+#ifdef SOFTRAST_SSE2
+    // Bit k is set if pixel x + k of row y (k < nLanes) is inside t and nearer than the depth buffer,
+    // whose entries for those pixels are then replaced by t's depth.
+    static int coverQuad(const Triangle& t, int x, float py, int nLanes, float* depthRow) {
+        const __m128 zero = _mm_setzero_ps();
+        __m128 px = _mm_add_ps(_mm_set1_ps(x + 0.5f), _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+        __m128 inside = _mm_castsi128_ps(_mm_cmplt_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(nLanes)));
+        __m128 z = zero;
+        for(int i=0; i < 3; i++) {
+            __m128 w = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.a[i]), px), _mm_set1_ps(t.b[i] * py + t.c[i]));
+            inside = _mm_and_ps(inside, t.topLeft[i] ? _mm_cmpge_ps(w, zero) : _mm_cmpgt_ps(w, zero));
+            z = _mm_add_ps(z, _mm_mul_ps(w, _mm_set1_ps(t.z[i])));
+        }
+        __m128 old = _mm_loadu_ps(depthRow);
+        __m128 pass = _mm_and_ps(inside, _mm_cmplt_ps(z, old));
+        _mm_storeu_ps(depthRow, _mm_or_ps(_mm_and_ps(pass, z), _mm_andnot_ps(pass, old)));
+        return _mm_movemask_ps(pass);
+    }
+#else
+    static int coverQuad(const Triangle& t, int x, float py, int nLanes, float* depthRow) {
+        int mask = 0;
+        for(int k=0; k < nLanes; k++) {
+            float px = x + k + 0.5f, z = 0.0f;
+            bool inside = true;
+            for(int i=0; i < 3; i++) {
+                float w = t.a[i] * px + t.b[i] * py + t.c[i];
+                inside = inside && (t.topLeft[i] ? w >= 0.0f : w > 0.0f);
+                z += w * t.z[i];
+            }
+            if(inside && z < depthRow[k]) {
+                depthRow[k] = z;
+                mask |= 1 << k;
+            }
+        }
+        return mask;
+    }
+#endif
+
+    void shadePixel(const Triangle& t, int x, int y) {
+        float px = x + 0.5f, py = y + 0.5f;
+        float p[3], d = 0.0f;
+        for(int i=0; i < 3; i++) {
+            p[i] = (t.a[i] * px + t.b[i] * py + t.c[i]) * t.invW[i];
+            d += p[i];
+        }
+        for(int i=0; i < 3; i++) p[i] /= d; // Perspective correct weights
+
+        SoftFragment f;
+        f.x = x;
+        f.y = y;
+        f.position = t.v[0].position * p[0] + t.v[1].position * p[1] + t.v[2].position * p[2];
+        f.normal = t.v[0].normal * p[0] + t.v[1].normal * p[1] + t.v[2].normal * p[2];
+        f.texCoord = t.v[0].texCoord * p[0] + t.v[1].texCoord * p[1] + t.v[2].texCoord * p[2];
+        // u = U / D, with U and D affine in x and y, so du/dx = (dU/dx - u * dD/dx) / D
+        f.texCoordDx = vec2((t.dU[0] - f.texCoord.x * t.dD[0]) / d, (t.dV[0] - f.texCoord.y * t.dD[0]) / d);
+        f.texCoordDy = vec2((t.dU[1] - f.texCoord.x * t.dD[1]) / d, (t.dV[1] - f.texCoord.y * t.dD[1]) / d);
+
+        vec3 rgb = t.shader->shade(f);
+        unsigned char* out = &color[(size_t)3 * (stride * y + x)];
+        out[0] = toByte(rgb.x);
+        out[1] = toByte(rgb.y);
+        out[2] = toByte(rgb.z);
+    }
+
+    void rasterizeTile(int tile) {
+        int x0 = (tile % tilesX) * tileSize, y0 = (tile / tilesX) * tileSize;
+        int x1 = std::min(x0 + tileSize, width) - 1, y1 = std::min(y0 + tileSize, height) - 1;
+        const std::vector<int>& bin = bins[tile];
+        for(size_t n=0; n < bin.size(); n++) {
+            const Triangle& t = triangles[bin[n]];
+            int left = std::max(x0, t.minX) & ~3, right = std::min(x1, t.maxX);
+            for(int y = std::max(y0, t.minY); y <= std::min(y1, t.maxY); y++) {
+                float* depthRow = &depth[(size_t)stride * y];
+                for(int x = left; x <= right; x += 4) {
+                    int mask = coverQuad(t, x, y + 0.5f, std::min(4, right - x + 1), depthRow + x);
+                    for(int k=0; mask != 0; k++, mask >>= 1)
+                        if(mask & 1) shadePixel(t, x + k, y);
+                }
+            }
+        }
+    }
+
+    const int stride; // Pixels per row of the buffers, a multiple of 4
+    const int tileSize, tilesX, tilesY; // Tiles are numbered across then up, from the bottom left
+    std::vector<unsigned char> color; // RGB, bottom row first
+    std::vector<float> depth;
+    std::vector<Triangle> triangles; // This frame's, in the order they were drawn
+    std::vector<std::vector<int> > bins; // The triangles touching each tile
+
+    std::vector<double> tileMs, tileMaxMs; // Each tile's total and longest time
+    std::vector<long long> tileTriangles;
+    int frames, threads;
+    double setupMs, renderMs;
+};
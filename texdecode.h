@@ -0,0 +1,108 @@
+// Fast reading of BMP texture files, for decoding textures on worker threads.
+// [GOZ]: Used by scene.cpp in place of LoadDIBitmap for uncompressed 24 and 32 bit files, falling back to
+// it for anything else. Needs gnatidread.h's texture type. Files are mapped rather than read, and each
+// row is converted straight from the mapping to a bottom-up RGB row, as LoadDIBitmap would give.
+// Top-down files are flipped and row padding is skipped as the rows are converted. The BGR(A) to RGB
+// shuffle uses SSSE3 when the CPU has it, whatever the compiler flags.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TEXDECODE_SSSE3
+#endif
+
+static inline uint32_t bmpU32(const uint8_t* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint16_t bmpU16(const uint8_t* p) { return p[0] | p[1] << 8; }
+
+// Convert n BGR (bytesPerPixel 3) or BGRA (4) pixels to RGB.
+static void bmpRowScalar(const uint8_t* src, uint8_t* dst, int n, int bytesPerPixel) {
+    for(int x=0; x < n; x++, src += bytesPerPixel, dst += 3) {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+    }
+}
+
+#ifdef TEXDECODE_SSSE3
+// As bmpRowScalar, 5 BGR or 4 BGRA pixels per shuffle. Each step reads and writes 16 bytes, of which
+// the last (or last 4) are rewritten by the next step, so the loops stop while the row has room for that.
+__attribute__((target("ssse3")))
+static void bmpRowSSSE3(const uint8_t* src, uint8_t* dst, int n, int bytesPerPixel) {
+    int x = 0;
+    if(bytesPerPixel == 3) {
+        const __m128i bgrToRgb = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+        for(; x + 6 <= n; x += 5) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + 3 * x));
+            _mm_storeu_si128((__m128i*)(dst + 3 * x), _mm_shuffle_epi8(v, bgrToRgb));
+        }
+    } else {
+        const __m128i bgraToRgb = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+        for(; x + 6 <= n; x += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + 4 * x));
+            _mm_storeu_si128((__m128i*)(dst + 3 * x), _mm_shuffle_epi8(v, bgraToRgb));
+        }
+    }
+    bmpRowScalar(src + bytesPerPixel * x, dst + 3 * x, n - x, bytesPerPixel);
+}
+#endif
+
+static void bmpConvertRow(const uint8_t* src, uint8_t* dst, int n, int bytesPerPixel) {
+#ifdef TEXDECODE_SSSE3
+    static const bool ssse3 = __builtin_cpu_supports("ssse3");
+    if(ssse3) {
+        bmpRowSSSE3(src, dst, n, bytesPerPixel);
+        return;
+    }
+#endif
+    bmpRowScalar(src, dst, n, bytesPerPixel);
+}
+
+// Read an uncompressed 24 or 32 bit BMP file into a texture (malloc'd, as loadTexture's are). Returns
+// NULL if the file can't be read or is some other kind of BMP. Safe to call from any thread.
+texture* decodeBMP(const char* fileName) {
+    int fd = open(fileName, O_RDONLY);
+    if(fd < 0) return NULL;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < 54) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED) return NULL;
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    madvise(mapping, size, MADV_WILLNEED); // Start reading the whole file
+
+    const uint8_t* file = (const uint8_t*)mapping;
+    size_t offset = bmpU32(file + 10);
+    int width = (int32_t)bmpU32(file + 18), height = (int32_t)bmpU32(file + 22);
+    int bytesPerPixel = bmpU16(file + 28) / 8;
+    int rows = abs(height);
+    size_t stride = ((size_t)width * bytesPerPixel + 3) & ~(size_t)3; // Rows are padded to 4 bytes
+
+    texture* t = NULL;
+    if(file[0] == 'B' && file[1] == 'M' && bmpU32(file + 14) >= 40 && bmpU32(file + 30) == 0 &&
+            (bytesPerPixel == 3 || bytesPerPixel == 4) && width > 0 && rows > 0 &&
+            offset + stride * (rows - 1) + (size_t)width * bytesPerPixel <= size) {
+        t = (texture*)malloc(sizeof(texture));
+        t->width = width;
+        t->height = rows;
+        t->rgbData = (GLubyte*)malloc((size_t)3 * width * rows);
+        for(int y=0; y < rows; y++) {
+            const uint8_t* src = file + offset + stride * (height < 0 ? rows - 1 - y : y);
+            bmpConvertRow(src, t->rgbData + (size_t)3 * width * y, width, bytesPerPixel);
+        }
+    }
+    munmap(mapping, size);
+    return t;
+}
@@ -0,0 +1,114 @@
+// A small pool of worker threads for splitting CPU work across cores.
+// [GOZ]: Used by scene.cpp for light binning, texture decoding and software rendering. Tasks are plain
+// std::function objects.
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <deque>
+
+class ThreadPool {
+public:
+    // Start nThreads workers, or one per hardware thread less one (for the calling thread) if 0.
+    ThreadPool(int nThreads = 0) : stopping(false) {
+        if(nThreads <= 0) nThreads = (int)std::thread::hardware_concurrency() - 1;
+        for(int i=0; i < nThreads; i++)
+            workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(size_t i=0; i < workers.size(); i++) workers[i].join();
+    }
+
+    int size() const { return (int)workers.size(); }
+
+    // Whether the calling thread is one of the workers.
+    bool onWorker() const {
+        for(size_t i=0; i < workers.size(); i++)
+            if(workers[i].get_id() == std::this_thread::get_id()) return true;
+        return false;
+    }
+
+    // Queue a task to run on a worker thread, without waiting for it.
+    void run(const std::function<void()>& task) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            tasks.push_back(task);
+        }
+        wake.notify_one();
+    }
+
+    // Call fn(i) for each i in [0, n), spread over the workers and the calling thread.
+    // Returns once every call has finished. The helpers go ahead of tasks queued with run(), and the
+    // caller only waits for helpers that started before it ran out of calls. The rest do nothing.
+    void parallelFor(int n, const std::function<void(int)>& fn) {
+        std::shared_ptr<ForJob> job = std::make_shared<ForJob>(n, &fn);
+        int nHelpers = std::min(size(), n - 1);
+        if(nHelpers > 0) {
+            std::lock_guard<std::mutex> guard(lock);
+            for(int h=0; h < nHelpers; h++)
+                tasks.push_front([this, job]() { help(*job); });
+        }
+        for(int h=0; h < nHelpers; h++) wake.notify_one();
+
+        job->work();
+
+        std::unique_lock<std::mutex> waitLock(lock);
+        job->closed = true;
+        job->finished.wait(waitLock, [&]() { return job->running == 0; });
+    }
+
+private:
+    // A parallelFor call. Shared with its helper tasks, which may outlive the call if they start late.
+    struct ForJob {
+        ForJob(int n, const std::function<void(int)>* fn) : n(n), fn(fn), next(0), running(0), closed(false) {}
+        void work() { for(int i = next++; i < n; i = next++) (*fn)(i); }
+
+        const int n;
+        const std::function<void(int)>* fn; // Only called before closed
+        std::atomic<int> next;
+        int running; // Helpers in work(), guarded by lock
+        bool closed; // The caller has run out of calls and is waiting, guarded by lock
+        std::condition_variable finished;
+    };
+
+    void help(ForJob& job) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if(job.closed) return;
+            job.running++;
+        }
+        job.work();
+        std::lock_guard<std::mutex> guard(lock);
+        if(--job.running == 0 && job.closed) job.finished.notify_one();
+    }
+
+    void workerLoop() {
+        for(;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> waitLock(lock);
+                wake.wait(waitLock, [this]() { return stopping || !tasks.empty(); });
+                if(stopping && tasks.empty()) return;
+                task = tasks.front();
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()> > tasks;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping;
+};
@@ -0,0 +1,20 @@
+#version 150
+
+// [GOZ]: Draws one view of a mesh into an impostor atlas, see Impostors in scene.cpp. Projection is
+// an orthographic view of the mesh's bounding sphere, sized to the sphere in all three dimensions.
+
+in  vec4 vPosition;
+in  vec3 vNormal;
+in  vec2 vTexCoord;
+
+out vec3 normal;
+out vec2 texCoord;
+
+uniform mat4 Projection;
+
+void main()
+{
+	normal = vNormal;
+	texCoord = vTexCoord;
+	gl_Position = Projection * vPosition;
+}
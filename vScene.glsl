@@ -1,32 +1,126 @@
 #version 150
 
+// [GOZ]: Compiled with SKINNED defined for meshes with bones. Static meshes skip the bone blending.
+// SKIN_ONE_BONE (for distant objects) only uses the first bone, which scene.cpp makes the heaviest.
+// INDIRECT is for static meshes drawn with glMultiDrawElementsIndirect, see GPU-driven drawing in scene.cpp.
+// IMPOSTOR draws a static mesh's impostor as a card, see Impostors in scene.cpp.
+// PICK (with INDIRECT or IMPOSTOR) writes an object ID for picking, see pickObject in scene.cpp.
+
 in  vec4 vPosition;
 in  vec3 vNormal;
 in  vec2 vTexCoord;
 
+#ifdef SKINNED
 	//[TFD]: part D.A1
 in ivec4 boneIDs;
 in  vec4 boneWeights;
 uniform mat4 boneTransforms[64];
+#endif
 
 out  vec4 position;
 out  vec3 normal;
 out  vec2 texCoord;
 
+#ifdef INDIRECT
+// [GOZ]: Each instance is one object, whose texels in objectData are the columns of its model matrix,
+// then its material, then its fade. What fScene.glsl would otherwise get as uniforms is passed on to it.
+#define OBJECT_TEXELS 10
+in int vObjectIndex;
+uniform samplerBuffer objectData;
+uniform mat4 View;
+flat out mat4 ModelView;
+flat out vec3 AmbientProduct, DiffuseProduct, SpecularProduct;
+flat out float Shininess;
+flat out int texLayer;	// -1 for a plain texture
+flat out float texScale;
+flat out vec3 texColor;
+flat out float Fade;
+#ifdef PICK
+flat out int pickId;	// The index into the objects drawn, plus one
+#endif
+#else
 uniform mat4 ModelView;
+#endif
 uniform mat4 Projection;
 
+#ifdef IMPOSTOR
+// [GOZ]: The card is drawn as a 4 vertex triangle strip without vertex attributes. It faces the view in
+// the atlas nearest the camera, whose grid of IMPOSTOR_GRID x IMPOSTOR_GRID views is an octahedral map
+// of directions from the mesh's origin. The basis for each view must match bakeImpostor in scene.cpp.
+#define IMPOSTOR_GRID 8.0
+uniform float impostorRadius;	// The mesh's bounding sphere, which each view covers
+out vec2 atlasCoord;
+flat out vec3 impostorDir;	// Towards the camera that drew the view, in object space
+
+vec2 octEncode( vec3 d )
+{
+	vec2 p = d.xz / ( abs(d.x) + abs(d.y) + abs(d.z) );
+	if( d.y < 0.0 ) p = ( 1.0 - abs(p.yx) ) * vec2( p.x >= 0.0 ? 1.0 : -1.0, p.y >= 0.0 ? 1.0 : -1.0 );
+	return p * 0.5 + 0.5;
+}
+
+vec3 octDecode( vec2 uv )
+{
+	vec2 p = uv * 2.0 - 1.0;
+	vec3 d = vec3( p.x, 1.0 - abs(p.x) - abs(p.y), p.y );
+	if( d.y < 0.0 ) d.xz = ( 1.0 - abs(p.yx) ) * vec2( p.x >= 0.0 ? 1.0 : -1.0, p.y >= 0.0 ? 1.0 : -1.0 );
+	return normalize( d );
+}
+#endif
+
 void main()
 {
+#ifdef INDIRECT
+	int base = vObjectIndex * OBJECT_TEXELS;
+	ModelView = View * mat4( texelFetch(objectData, base), texelFetch(objectData, base + 1),
+							 texelFetch(objectData, base + 2), texelFetch(objectData, base + 3) );
+	vec4 ambientShine = texelFetch(objectData, base + 4);
+	vec4 diffuseScale = texelFetch(objectData, base + 5);
+	vec4 specularLayer = texelFetch(objectData, base + 6);
+	AmbientProduct = ambientShine.rgb;
+	Shininess = ambientShine.a;
+	DiffuseProduct = diffuseScale.rgb;
+	texScale = diffuseScale.a;
+	SpecularProduct = specularLayer.rgb;
+	texLayer = int(specularLayer.a);
+	texColor = texelFetch(objectData, base + 7).rgb;
+	Fade = texelFetch(objectData, base + 9).r;
+#ifdef PICK
+	pickId = vObjectIndex + 1;
+#endif
+#endif
+
+#if defined(IMPOSTOR)
+	vec3 eye = normalize( (inverse(ModelView) * vec4(0.0, 0.0, 0.0, 1.0)).xyz );
+	vec2 cell = min( floor( octEncode(eye) * IMPOSTOR_GRID ), IMPOSTOR_GRID - 1.0 );
+	impostorDir = octDecode( (cell + 0.5) / IMPOSTOR_GRID );
+	vec3 up = abs(impostorDir.y) > 0.999 ? vec3(0.0, 0.0, 1.0) : vec3(0.0, 1.0, 0.0);
+	vec3 right = normalize( cross(up, impostorDir) );
+	up = cross( impostorDir, right );
+
+	vec2 corner = vec2( gl_VertexID & 1, gl_VertexID >> 1 );
+	atlasCoord = (cell + corner) / IMPOSTOR_GRID;
+	corner = corner * 2.0 - 1.0;
+	vec4 positionTransform = vec4( (right * corner.x + up * corner.y) * impostorRadius, 1.0 );
+	vec3 normalTransform = impostorDir;	// Replaced by the atlas's normals in fScene.glsl
+#elif defined(SKINNED)
+#ifdef SKIN_ONE_BONE
+	mat4 boneTransform = boneTransforms[boneIDs[0]];
+#else
 	//[TFD]: part D.A2
 	mat4 boneTransform = boneWeights[0] * boneTransforms[boneIDs[0]]	+
 						 boneWeights[1] * boneTransforms[boneIDs[1]]	+
 						 boneWeights[2] * boneTransforms[boneIDs[2]]	+
 						 boneWeights[3] * boneTransforms[boneIDs[3]];
+#endif
 
 	//[TFD]: part D.A3, 4th element of vNormal should be 0, as with normalTransform
 	vec4 positionTransform = boneTransform * vPosition;
 	vec3 normalTransform = mat3 ( boneTransform ) * vNormal;
+#else
+	vec4 positionTransform = vPosition;
+	vec3 normalTransform = vNormal;
+#endif
 	
 	position = positionTransform;
 	normal = normalTransform;